@@ -0,0 +1,4169 @@
+/*
+  img2dcpu - A utility for converting an image into DCPU assembly code for 0x10c.
+
+  Copyright 2012 Tyler Crumpton.
+  This utility is licensed under a GPLv3 License (see COPYING).
+  Source at: https://github.com/tac0010/img2dcpu
+*/
+
+#include "img2dcpu.h"
+
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+#ifndef __WIN32__
+    #include <unistd.h>
+    #include <dirent.h>
+    #include <utime.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <sys/file.h>
+    #include <fcntl.h>
+#endif
+
+using namespace std;
+
+struct Dcpu;
+struct ResampleAxis;
+struct FrameFit;
+uint64_t hashBytes(const void *data, size_t length, uint64_t hash);
+int encodeOperand(const string &operand, bool isA, WORD &nextWord, string &nextLabel, bool &hasNextWord);
+void resetDcpu(Dcpu &cpu, const vector<WORD> &program);
+int stepDcpu(Dcpu &cpu);
+WORD *dcpuOperand(Dcpu &cpu, int code, bool isA, int &cycles);
+void dcpuInterrupt(Dcpu &cpu, WORD message);
+int dcpuHardware(Dcpu &cpu, WORD device);
+void renderScreen(const Dcpu &cpu, WORD *pixels);
+void rgbToLab(int red, int green, int blue, float lab[3]);
+void popularPalette(const uint64_t colorCounts[4096], int palette[16][3]);
+int medianCutPalette(const uint64_t colorCounts[4096], int palette[16][3]);
+void kMeansPalette(const uint64_t colorCounts[4096], int palette[16][3]);
+WORD generateHighResFullTile(const uint64_t *plane, int column, int row);
+void generateHighResSmallTile(const uint64_t *plane, int column, int row, WORD glyph[2]);
+bool readCacheEntry(const string &path, const uint64_t key[2], WORD *words, int count);
+int64_t writeCacheEntry(const string &dir, const string &path, const uint64_t key[2], const WORD *words, int count);
+void updateCacheStats(const string &dir, uint64_t limit, int64_t bytesAdded, int64_t hits, int64_t misses);
+void planFrameFit(int sourceWidth, int sourceHeight, int mode, int fitPolicy, int filter, FrameFit &fit);
+void resampleFrame(const FrameFit &fit, const BYTE *source, int64_t sourceStride, BYTE *target,
+                   int64_t targetStride);
+void resampleAxis(double start, double length, int sourceSize, int targetSize, int filter, ResampleAxis &axis);
+float lanczosWeight(double distance);
+bool readStreamHeader(FrameStream &input);
+bool readStreamFrame(FrameStream &input, BYTE *raw);
+void streamFrameToBGR(const FrameStream &input, const BYTE *raw, BYTE *pixels, int64_t stride);
+int64_t tellStream(FILE *file);
+bool seekStream(FILE *file, int64_t position);
+void addWeightedBytes(const BYTE *bytes, float weight, float *sums, int64_t count);
+string jsonString(const string &text);
+
+const char *codecNames[] = {"none", "rle", "lz"};
+const int centerOffset = 64 + 8;
+
+//Lookup tables for the black and white modes, which work on frames thresholded into 1-bit planes.
+struct BitPlaneTables {
+    BYTE everyThirdBit[4096]; //Bits 0, 3, 6 and 9 of a 12-bit value, packed together
+    WORD fullTiles[256];      //Screen word of a 2x4 tile, from its black pixels two bits per row
+    uint32_t spreadBits[16];  //Bit n of a 4-bit value moved to bit 0 of byte n
+
+    BitPlaneTables() {
+        for (int value=0; value<4096; ++value) {
+            everyThirdBit[value] = (value & 1) | (value >> 2 & 2) | (value >> 4 & 4) | (value >> 6 & 8);
+        }
+        for (int tile=0; tile<256; ++tile) {
+            //A tile is inverted when its second pixel of the second row is white, and its character then
+            //has the black pixels set instead of the white ones:
+            bool inverted = !(tile >> 3 & 1);
+            int bits = ~tile ^ (inverted ? 0xFF : 0x00);
+            int character = (bits >> 1 & 1) | (bits >> 5 & 1) << 1 | (bits >> 7 & 1) << 2 | (bits & 1) << 3 |
+                            (bits >> 2 & 1) << 4 | (bits >> 4 & 1) << 5 | (bits >> 6 & 1) << 6;
+            fullTiles[tile] = (inverted ? 0x0100 : 0x1000) + character;
+        }
+        for (int value=0; value<16; ++value) {
+            spreadBits[value] = (value & 1) | (value >> 1 & 1) << 8 | (value >> 2 & 1) << 16 | (value >> 3 & 1) << 24;
+        }
+    }
+};
+const BitPlaneTables bitPlaneTables;
+
+//The source pixels that make up each pixel along one axis of a resampled image: pixel i is the sum of source
+//pixels first[i] to first[i] + taps - 1 times weights[i * taps] onwards. Every pixel has the same number of
+//taps, padded with zero weights, so the loops over them all run the same length.
+struct ResampleAxis {
+    int taps;
+    vector<int> first;
+    vector<float> weights;
+};
+
+//How frames of one size are resampled to the frames of a mode: the weights along each axis, and where the
+//fitted frame goes in the mode's frame.
+struct FrameFit {
+    int sourceWidth, sourceHeight;
+    int targetX, targetY, fittedWidth, fittedHeight;
+    ResampleAxis columns, rows;
+};
+
+const int modeSizes[3][2] = {{LOW_RES_FULL_W, LOW_RES_FULL_H}, {HIGH_RES_FULL_W, HIGH_RES_FULL_H},
+                             {HIGH_RES_SMALL_W, HIGH_RES_SMALL_H}};
+
+const char *fitNames[] = {"letterbox", "crop", "stretch"};
+
+//Layouts of an animation's frames that the planner chooses between, from the cheapest to play to the dearest.
+enum {PLAIN_LAYOUT, DEDUP_LAYOUT, DELTA_LAYOUT, GLYPH_LAYOUT, RLE_LAYOUT, LZ_LAYOUT, LAYOUT_COUNT};
+const char *layoutNames[] = {"plain", "dedup", "delta", "glyphs", "rle", "lz"};
+const char *filterNames[] = {"box", "Lanczos"};
+
+//Formats of the frames in a stream.
+enum {RAW_RGB_STREAM, Y4M_420_STREAM, Y4M_422_STREAM, Y4M_444_STREAM, Y4M_MONO_STREAM};
+
+//A stream of frames, read a window at a time. The frames of the window are resampled to the mode's frames
+//and kept side by side in "window", with the same layout as a bitmap's rows.
+struct FrameStream {
+    FILE *file;
+    int format;
+    int width, height;
+    bool fullRange;      //Y4M samples use all of 0-255, rather than 16-235 for luma and 16-240 for chroma
+    int64_t frameBytes;  //Bytes of samples in each frame
+    int64_t dataStart;   //File position of the first frame, or -1 if the stream can't go back to it
+    int64_t nextFrame;   //Frame that the next read returns
+    bool ended;
+    bool resample;       //The frames aren't the mode's size, and are resampled as "fit" says
+    FrameFit fit;
+    vector<BYTE> window;
+    vector<BYTE> raw;    //Frames read, before they're converted into the window
+};
+
+//Entries of the frame cache directory are named by a 128-bit key of everything a frame's words depend on, and
+//hold this header followed by the words. CACHE_VERSION is part of the key, and must change whenever the words
+//of a frame would.
+const uint32_t CACHE_MAGIC = 0x43443249; //"I2DC"
+const uint32_t CACHE_VERSION = 1;
+
+struct CacheEntryHeader {
+    uint32_t magic;
+    uint32_t wordCount;
+    uint64_t key[2];
+};
+
+atomic<uint64_t> cacheTempCount(0); //Makes the names of the cache's temporary files unique in this process
+
+//A headless DCPU-16 1.7 with a LEM1802 monitor (device 0) and a generic clock (device 1).
+const int DCPU_HZ = 100000;
+const int SCREEN_W = 128;
+const int SCREEN_H = 96;
+const WORD lemDefaultPalette[16] = {0x000, 0x00a, 0x0a0, 0x0aa, 0xa00, 0xa0a, 0xa50, 0xaaa,
+                                    0x555, 0x55f, 0x5f5, 0x5ff, 0xf55, 0xf5f, 0xff5, 0xfff};
+
+struct Dcpu {
+    vector<WORD> memory;
+    WORD registers[8];        //A, B, C, X, Y, Z, I, J
+    WORD pc, sp, ex, ia;
+    bool queueing;            //Interrupts are queued instead of triggered
+    vector<WORD> interrupts;
+    uint64_t cycles;
+    uint64_t hwiCount;
+    WORD literal;             //Holds literal operands, so that writes to them are lost
+    string fault;             //Set when the program does something the DCPU can't
+    WORD screen, font, palette, border; //LEM1802 memory maps, 0 when unmapped
+    WORD clockInterval;       //The clock ticks 60/clockInterval times a second, or not at all when 0
+    WORD clockMessage;
+    uint64_t clockStart, clockTicks;
+};
+
+Converter::Converter(const ConverterOptions &converterOptions) : options(converterOptions) {
+    hfile = 0;
+    memset(&bfh, 0, sizeof(bfh));
+    memset(&bih, 0, sizeof(bih));
+    mapping = NULL;
+    mappingSize = 0;
+    setFrameLayout(NULL, 0, 0, 0);
+    animationFlag = false;
+    imageMode = LOW_RES_FULL;
+    memset(currentPalette, 0, sizeof(currentPalette));
+    uniqueFrames = 0;
+    fontCount = 0;
+    outputUsed = 0;
+    outputWritten = 0;
+    outputFailed = false;
+    outputFile = 0;
+    outputStream = NULL;
+    datLine = false;
+    wordAddress = 0;
+    memoryImage = NULL;
+    paletteSeconds = tileSeconds = writeSeconds = 0;
+    cacheFrames = false;
+    cacheMode = -1;
+    memset(cachePalette, 0, sizeof(cachePalette));
+    convertedFrames = 0;
+    frameDataOffset = -1;
+    cacheHits = cacheMisses = cacheBytesAdded = 0;
+    flushedHits = flushedMisses = flushedBytes = 0;
+    quantizedFrames = 0;
+    frameStep = 1;
+    unsteppedFrames = unsteppedStride = 0;
+    stream = NULL;
+    firstColumn = 0;
+    streamFrames = 0;
+}
+
+Converter::~Converter() {
+    closeImage();
+}
+
+//Maps a 24-bit bitmap file into memory so its pixels can be read in place. Returns false if it isn't a
+//readable 24-bit bitmap.
+bool Converter::readImage(const char *filename) {
+    closeImage();
+    #ifdef __WIN32__
+        //Open and map the file
+        hfile = CreateFile(filename,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+        if (hfile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(hfile, &fileSize);
+        mappingSize = fileSize.QuadPart;
+        HANDLE hmapping = CreateFileMapping(hfile,NULL,PAGE_READONLY,0,0,NULL);
+        CloseHandle(hfile);  //The mapping keeps the file open
+        if (hmapping == NULL) {
+            return false;
+        }
+        mapping = (const BYTE *)MapViewOfFile(hmapping,FILE_MAP_READ,0,0,0);
+        CloseHandle(hmapping);  //The view keeps the mapping open
+        if (mapping == NULL) {
+            return false;
+        }
+    #else
+        //Open and map the file
+        hfile = open(filename, O_RDONLY);
+        if (hfile < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(hfile, &info) != 0 || info.st_size == 0) {
+            close(hfile);
+            return false;
+        }
+        mappingSize = info.st_size;
+        void *view = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, hfile, 0);
+        close(hfile);  //The mapping keeps the file open
+        if (view == MAP_FAILED) {
+            return false;
+        }
+        mapping = (const BYTE *)view;
+    #endif
+
+    //Read the header
+    if (mappingSize < (int64_t)(sizeof(bfh) + sizeof(bih))) {
+        closeImage();
+        return false;
+    }
+    memcpy(&bfh, mapping, sizeof(bfh));
+    memcpy(&bih, mapping + sizeof(bfh), sizeof(bih));
+    if (bfh.bfType != 0x4D42 || bih.biBitCount != 24 || bih.biCompression != 0 || bih.biWidth <= 0 || bih.biHeight == 0) {
+        closeImage();
+        return false;
+    }
+
+    //Rows are padded to 4 bytes and stored bottom-up, unless the height is negative:
+    int64_t stride = ((int64_t)bih.biWidth * 3 + 3) & ~(int64_t)3;
+    bool topDown = bih.biHeight < 0;
+    if (topDown) {
+        bih.biHeight = -bih.biHeight; //Everything else works with the height as a row count
+    }
+    if ((int64_t)bfh.bfOffBits + stride * bih.biHeight > mappingSize) {
+        closeImage();
+        return false;
+    }
+    if (topDown) {
+        topRow = mapping + bfh.bfOffBits;
+        rowStride = stride;
+    }
+    else {
+        topRow = mapping + bfh.bfOffBits + stride * (bih.biHeight - 1);
+        rowStride = -stride;
+    }
+    return true;
+}
+
+//Uses "width" by "height" 24-bit BGR pixels from memory as the image, starting at the top left with "stride"
+//bytes from one row to the next one down. The pixels are read in place, so they must outlive the conversion.
+//Returns false if the size is invalid.
+bool Converter::setPixels(const BYTE *pixels, int width, int height, int64_t stride) {
+    closeImage();
+    if (pixels == NULL || width <= 0 || height <= 0 || (stride < 0 ? -stride : stride) < (int64_t)width * 3) {
+        return false;
+    }
+    memset(&bfh, 0, sizeof(bfh));
+    memset(&bih, 0, sizeof(bih));
+    bfh.bfType = 0x4D42;
+    bih.biSize = sizeof(bih);
+    bih.biWidth = width;
+    bih.biHeight = height;
+    bih.biPlanes = 1;
+    bih.biBitCount = 24;
+    topRow = pixels;
+    rowStride = stride;
+    return true;
+}
+
+//Reads frames from "input" instead of a bitmap: a Y4M stream, or with "rawWidth" and "rawHeight", raw 24-bit
+//RGB frames of that size one after another. Frames are read as they're converted, a window at a time, so a
+//stream of any length takes the same memory. The file must stay open until the program is written. Returns
+//false if the Y4M header can't be read or the frames are in a format that isn't supported.
+bool Converter::openStream(FILE *input, int rawWidth, int rawHeight) {
+    closeImage();
+    FrameStream *reader = new FrameStream();
+    reader->file = input;
+    reader->format = RAW_RGB_STREAM;
+    reader->width = rawWidth;
+    reader->height = rawHeight;
+    reader->fullRange = false;
+    reader->nextFrame = 0;
+    reader->ended = false;
+    reader->resample = false;
+    if (rawWidth <= 0 ? !readStreamHeader(*reader) : rawHeight <= 0) {
+        delete reader;
+        return false;
+    }
+    if (reader->format == RAW_RGB_STREAM) {
+        reader->frameBytes = (int64_t)reader->width * reader->height * 3;
+    }
+    reader->dataStart = tellStream(input);
+
+    memset(&bfh, 0, sizeof(bfh));
+    memset(&bih, 0, sizeof(bih));
+    bfh.bfType = 0x4D42;
+    bih.biSize = sizeof(bih);
+    bih.biWidth = reader->width; //The size of one frame, until the mode is selected
+    bih.biHeight = reader->height;
+    bih.biPlanes = 1;
+    bih.biBitCount = 24;
+    stream = reader;
+    streamFrames = 0;
+    return true;
+}
+
+//Unmaps the bitmap opened by readImage(), or lets go of the pixels given to setPixels() or the stream given
+//to openStream().
+void Converter::closeImage() {
+    if (mapping != NULL) {
+        #ifdef __WIN32__
+            UnmapViewOfFile(mapping);
+        #else
+            munmap((void *)mapping, mappingSize);
+        #endif
+    }
+    mapping = NULL;
+    setFrameLayout(NULL, 0, 0, 0);
+    vector<BYTE>().swap(framePixels);
+    vector<WORD>().swap(quantizedColors);
+    quantizedFrames = 0;
+    frameStep = 1;
+    delete stream; //The stream's file belongs to the caller
+    stream = NULL;
+    firstColumn = 0;
+}
+
+//Picks the conversion mode from the bitmap's size. Returns 0, or 2 if the size isn't supported.
+int Converter::selectImageMode(ostream &log) {
+    if (stream != NULL) {
+        return selectStreamMode(log);
+    }
+    int64_t frames = options.sourceFrames;
+    if (options.sheetColumns != 0 || options.sheetRows != 0) {
+        frames = gatherFrames(log);
+        if (frames < 0) {
+            return 2;
+        }
+    }
+    if (options.resampleMode >= 0 && !resampleImage(frames, log)) {
+        return 2;
+    }
+    if (bih.biWidth == 32 && bih.biHeight == 24) {
+        imageMode = LOW_RES_FULL;
+        animationFlag = false;
+        log << "   Mode Used : 32x24 Full Color, Full Screen.\n";
+    }
+    else if (bih.biWidth % 32 == 0 && bih.biHeight == 24) {
+        imageMode = LOW_RES_FULL;
+        animationFlag = true;
+        log << "   Mode Used : 32x24 Full Color, Full Screen, Animated.\n";
+    }
+    else if (bih.biWidth == 64 && bih.biHeight == 48) {
+        imageMode = HIGH_RES_FULL;
+        animationFlag = false;
+        log << "   Mode Used : 64x48 Black and White, Full Screen.\n";
+    }
+    else if (bih.biWidth % 64 == 0 && bih.biHeight == 48) {
+        imageMode = HIGH_RES_FULL;
+        animationFlag = true;
+        log << "   Mode Used : 64x48 Black and White, Full Screen, Animated.\n";
+    }
+    else if (bih.biWidth == 64 && bih.biHeight == 64) {
+        imageMode = HIGH_RES_SMALL;
+        animationFlag = false;
+        log << "   Mode Used : 64x64 Black and White, Centered.\n";
+    }
+    else if (bih.biWidth % 64 == 0 && bih.biHeight == 64) {
+        imageMode = HIGH_RES_SMALL;
+        animationFlag = true;
+        log << "   Mode Used : 64x64 Black and White, Centered, Animated.\n";
+    }
+    else {
+        log << "\nError: img2dcpu currently only supports 32x24 color or 64x48/64x64 b&w images.\n";
+        log << "Other sizes can be resampled to one of them with --resize.\n";
+        return 2;
+    }
+    return 0;
+}
+
+//Picks the mode of a stream: the one given for resampling, or the one its frames are the size of. Streams are
+//always animations. Returns 0, or 2 after saying why in "log" if the stream can't be converted that way or has
+//no frames.
+int Converter::selectStreamMode(ostream &log) {
+    static const char *modeNames[] = {"32x24 Full Color, Full Screen", "64x48 Black and White, Full Screen",
+                                      "64x64 Black and White, Centered"};
+    int width = stream->width, height = stream->height;
+    imageMode = options.resampleMode;
+    for (int mode=0; mode<3 && imageMode < 0; ++mode) {
+        if (width == modeSizes[mode][0] && height == modeSizes[mode][1]) {
+            imageMode = mode;
+        }
+    }
+    if (imageMode < 0) {
+        log << "\nError: Streamed frames of " << width << "x" << height << " must be resampled with --resize.\n";
+        return 2;
+    }
+    if (options.sheetColumns != 0 || options.sheetRows != 0) {
+        log << "\nError: A stream's frames come one at a time, so it can't be read as a sprite sheet.\n";
+        return 2;
+    }
+    //Only layouts that take the frames in order, holding a window of them, can be streamed:
+    if (options.frameDedup || options.glyphDictionary) {
+        log << "\nError: --dedup and --glyphs need every frame at once, so they can't be used with a stream.\n";
+        return 2;
+    }
+    double ticks = options.framesPerSecond > 0 ? 60 / options.framesPerSecond : 1;
+    if (!options.frameHoldMs.empty() || ticks != floor(ticks)) {
+        log << "\nError: A stream can only be timed with an --fps that divides 60, and no --hold.\n";
+        return 2;
+    }
+    if (imageMode == LOW_RES_FULL && options.paletteFrames == 0 && !options.sharedPaletteReady &&
+        stream->dataStart < 0) {
+        log << "\nError: A palette from every frame reads the stream twice, so it must be a file.\n";
+        return 2;
+    }
+
+    animationFlag = true;
+    log << "   Mode Used : " << modeNames[imageMode] << ", Streamed.\n";
+    stream->resample = width != modeSizes[imageMode][0] || height != modeSizes[imageMode][1];
+    if (stream->resample) {
+        planFrameFit(width, height, imageMode, options.fitPolicy, options.resampleFilter, stream->fit);
+        log << "   Resampled : frames of " << width << "x" << height << " to " << modeSizes[imageMode][0] << "x"
+            << modeSizes[imageMode][1] << " (" << fitNames[options.fitPolicy] << ", "
+            << filterNames[options.resampleFilter] << " filter).\n";
+    }
+    bih.biWidth = 0;
+    bih.biHeight = modeSizes[imageMode][1];
+    if (loadFrames(0, 1) == 0) {
+        log << "\nError: The stream has no frames.\n";
+        return 2;
+    }
+    return 0;
+}
+
+//Reads the image as frames "width" pixels wide: side by side from "firstRow" when "frameBytes" is 0, or one
+//after another, "frameBytes" apart, otherwise. Rows are "stride" bytes apart either way. Frames one after
+//another can only be read through pixel() when their width is a power of 2, and through frameTop() otherwise.
+void Converter::setFrameLayout(const BYTE *firstRow, int width, int64_t stride, int64_t frameBytes) {
+    topRow = firstRow;
+    rowStride = stride;
+    frameStride = frameBytes;
+    frameShift = 62; //Every column is in the first frame
+    frameMask = INT64_MAX;
+    if (frameBytes != 0 && width > 0 && (width & (width - 1)) == 0) {
+        for (frameShift = 0; (1 << frameShift) < width; ++frameShift) {}
+        frameMask = width - 1;
+    }
+}
+
+//Returns the top left pixel of frame "x", for frames "width" pixels wide.
+const BYTE *Converter::frameTop(int64_t x, int width) {
+    if (frameStride == 0) {
+        return (const BYTE *)&pixel(x * width, 0);
+    }
+    return topRow + (x - firstColumn / width) * frameStride;
+}
+
+//Cuts a sprite sheet into options.sheetColumns by options.sheetRows frames, and makes the image the strip of
+//its first options.sourceFrames frames (or all of them), left to right and then top to bottom. The frames of a
+//single column are already one after another and are read in place; those of any other sheet are gathered
+//that way, a row of frames on each worker. Returns the number of frames, or -1 after saying why in "log" if
+//the sheet can't be cut that way.
+int64_t Converter::gatherFrames(ostream &log) {
+    int64_t columns = options.sheetColumns, rows = options.sheetRows, frames = options.sourceFrames;
+    if (rows == 0) {
+        //A vertical strip is cut into sourceFrames frames, or into frames of the one mode that fits it:
+        int fits = 0;
+        for (int mode=0; mode<3 && frames == 0; ++mode) {
+            if ((options.resampleMode < 0 || mode == options.resampleMode) && bih.biWidth == modeSizes[mode][0] &&
+                bih.biHeight % modeSizes[mode][1] == 0) {
+                rows = bih.biHeight / modeSizes[mode][1];
+                ++fits;
+            }
+        }
+        if (frames > 0) {
+            rows = frames;
+        }
+        else if (fits != 1) {
+            log << "\nError: Give the number of frames in the " << bih.biWidth << "x" << bih.biHeight
+                << " strip with --frames.\n";
+            return -1;
+        }
+    }
+    if (columns <= 0 || rows <= 0 || bih.biWidth % columns != 0 || bih.biHeight % rows != 0) {
+        log << "\nError: A " << bih.biWidth << "x" << bih.biHeight << " image can't be cut into " << columns << "x"
+            << rows << " frames.\n";
+        return -1;
+    }
+    if (frames == 0) {
+        frames = columns * rows;
+    }
+    if (frames > columns * rows) {
+        log << "\nError: A sheet of " << columns << "x" << rows << " frames doesn't have " << frames << " frames.\n";
+        return -1;
+    }
+
+    int width = bih.biWidth / columns, height = bih.biHeight / rows;
+    if (columns == 1) {
+        setFrameLayout(topRow, width, rowStride, rowStride * height);
+    }
+    else {
+        int64_t frameBytes = (int64_t)width * height * 3;
+        vector<BYTE> pixels(frames * frameBytes);
+        runWorkers((frames + columns - 1) / columns, [&](size_t sheetRow) {
+            int64_t first = sheetRow * columns, count = min(columns, frames - first);
+            for (int64_t row=0; row<height; ++row) {
+                const BYTE *source = topRow + (sheetRow * height + row) * rowStride;
+                for (int64_t column=0; column<count; ++column) {
+                    memcpy(&pixels[(first + column) * frameBytes + row * width * 3], source + column * width * 3,
+                           width * 3);
+                }
+            }
+        });
+        closeImage();
+        framePixels.swap(pixels);
+        setFrameLayout(&framePixels[0], width, width * 3, frameBytes);
+    }
+    log << "       Sheet : " << frames << (frames == 1 ? " frame of " : " frames of ") << width << "x" << height
+        << ", " << columns << " across and " << rows << " down.\n";
+    bih.biWidth = frames * width;
+    bih.biHeight = height;
+    return frames;
+}
+
+//Resamples the image to frames of options.resampleMode, unless they're that size already, cut into "frames"
+//frames (0 for the default). The resampled pixels are the image from then on. Returns false, after saying why
+//in "log", if the image can't be cut into that many frames.
+bool Converter::resampleImage(int64_t frames, ostream &log) {
+    int targetWidth = modeSizes[options.resampleMode][0], targetHeight = modeSizes[options.resampleMode][1];
+    if (frames == 0) {
+        if (bih.biHeight == targetHeight && bih.biWidth % targetWidth == 0) {
+            return true; //Already a strip of the mode's frames
+        }
+        frames = 1;
+    }
+    if (bih.biWidth % frames != 0) {
+        log << "\nError: A " << bih.biWidth << " pixel wide image can't be cut into " << frames << " frames.\n";
+        return false;
+    }
+    int sourceWidth = bih.biWidth / frames, sourceHeight = bih.biHeight;
+    if (sourceWidth == targetWidth && sourceHeight == targetHeight) {
+        return true;
+    }
+
+    FrameFit fit;
+    planFrameFit(sourceWidth, sourceHeight, options.resampleMode, options.fitPolicy, options.resampleFilter, fit);
+    int64_t frameBytes = (int64_t)targetWidth * targetHeight * 3;
+    vector<BYTE> pixels(frames * frameBytes, 0);
+    runWorkers(frames, [&](size_t frame) {
+        resampleFrame(fit, frameTop(frame, sourceWidth), rowStride, &pixels[frame * frameBytes], targetWidth * 3);
+    });
+
+    log << "   Resampled : " << frames << (frames == 1 ? " frame of " : " frames of ") << sourceWidth << "x"
+        << sourceHeight << " to " << targetWidth << "x" << targetHeight << " (" << fitNames[options.fitPolicy]
+        << ", " << filterNames[options.resampleFilter] << " filter).\n";
+    closeImage();
+    framePixels.swap(pixels);
+    setFrameLayout(&framePixels[0], targetWidth, targetWidth * 3, frameBytes);
+    bih.biWidth = frames * targetWidth;
+    bih.biHeight = targetHeight;
+    return true;
+}
+
+//Plans how frames of "sourceWidth" by "sourceHeight" are resampled to the frames of "mode". Letterboxing
+//scales a frame to fit inside the mode's frame and leaves black bars around it, cropping scales it to cover
+//the mode's frame and cuts off what's left over, and stretching fills the mode's frame.
+void planFrameFit(int sourceWidth, int sourceHeight, int mode, int fitPolicy, int filter, FrameFit &fit) {
+    fit.sourceWidth = sourceWidth;
+    fit.sourceHeight = sourceHeight;
+    fit.targetX = fit.targetY = 0;
+    fit.fittedWidth = modeSizes[mode][0];
+    fit.fittedHeight = modeSizes[mode][1];
+    double sourceX = 0, sourceY = 0, sourceW = sourceWidth, sourceH = sourceHeight;
+    double scaleX = (double)fit.fittedWidth / sourceWidth, scaleY = (double)fit.fittedHeight / sourceHeight;
+    if (fitPolicy == LETTERBOX_FIT) {
+        double scale = min(scaleX, scaleY);
+        int targetWidth = fit.fittedWidth, targetHeight = fit.fittedHeight;
+        fit.fittedWidth = max(1, min(targetWidth, (int)lround(sourceWidth * scale)));
+        fit.fittedHeight = max(1, min(targetHeight, (int)lround(sourceHeight * scale)));
+        fit.targetX = (targetWidth - fit.fittedWidth) / 2;
+        fit.targetY = (targetHeight - fit.fittedHeight) / 2;
+    }
+    else if (fitPolicy == CROP_FIT) {
+        double scale = max(scaleX, scaleY);
+        sourceW = min((double)sourceWidth, fit.fittedWidth / scale);
+        sourceH = min((double)sourceHeight, fit.fittedHeight / scale);
+        sourceX = (sourceWidth - sourceW) / 2;
+        sourceY = (sourceHeight - sourceH) / 2;
+    }
+    resampleAxis(sourceX, sourceW, sourceWidth, fit.fittedWidth, filter, fit.columns);
+    resampleAxis(sourceY, sourceH, sourceHeight, fit.fittedHeight, filter, fit.rows);
+}
+
+//Resamples one frame from "source" into its place in the mode's frame at "target", with "sourceStride" and
+//"targetStride" bytes from one row to the next. Each row is resampled down the columns first, into a line of
+//sums, then across. Pixels outside the fitted frame are left as they are.
+void resampleFrame(const FrameFit &fit, const BYTE *source, int64_t sourceStride, BYTE *target,
+                   int64_t targetStride) {
+    vector<float> line(fit.sourceWidth * 3);
+    for (int row=0; row<fit.fittedHeight; ++row) {
+        fill(line.begin(), line.end(), 0.0f);
+        for (int tap=0; tap<fit.rows.taps; ++tap) {
+            float weight = fit.rows.weights[row * fit.rows.taps + tap];
+            if (weight != 0) {
+                addWeightedBytes(source + (fit.rows.first[row] + tap) * sourceStride, weight, &line[0],
+                                 fit.sourceWidth * 3);
+            }
+        }
+        BYTE *out = target + (fit.targetY + row) * targetStride + fit.targetX * 3;
+        for (int column=0; column<fit.fittedWidth; ++column) {
+            const float *weights = &fit.columns.weights[column * fit.columns.taps];
+            const float *in = &line[fit.columns.first[column] * 3];
+            float blue = 0, green = 0, red = 0;
+            for (int tap=0; tap<fit.columns.taps; ++tap) {
+                blue += weights[tap] * in[tap * 3];
+                green += weights[tap] * in[tap * 3 + 1];
+                red += weights[tap] * in[tap * 3 + 2];
+            }
+            //Lanczos filters overshoot at sharp edges, so the sums are clamped:
+            out[0] = (BYTE)(min(max(blue, 0.0f), 255.0f) + 0.5f);
+            out[1] = (BYTE)(min(max(green, 0.0f), 255.0f) + 0.5f);
+            out[2] = (BYTE)(min(max(red, 0.0f), 255.0f) + 0.5f);
+            out += 3;
+        }
+    }
+}
+
+//Works out the weights for resampling the "length" source pixels from "start", out of "sourceSize", into
+//"targetSize" pixels. The box filter averages the source area under each pixel; the Lanczos filter has 3
+//lobes, widened to cover the same area when shrinking. Pixels past the edges repeat the edge pixels.
+void resampleAxis(double start, double length, int sourceSize, int targetSize, int filter, ResampleAxis &axis) {
+    double ratio = length / targetSize;
+    double scale = max(1.0, ratio);
+    vector<int> lows(targetSize);
+    vector<vector<double> > sums(targetSize);
+    axis.taps = 1;
+    for (int i=0; i<targetSize; ++i) {
+        double left, right;
+        if (filter == LANCZOS_FILTER) {
+            double center = start + (i + 0.5) * ratio;
+            left = center - 3 * scale;
+            right = center + 3 * scale;
+        }
+        else {
+            left = start + i * ratio;
+            right = left + ratio;
+        }
+        int firstPixel = (int)floor(left), endPixel = (int)ceil(right);
+        lows[i] = min(max(firstPixel, 0), sourceSize - 1);
+        sums[i].assign(min(max(endPixel - 1, 0), sourceSize - 1) - lows[i] + 1, 0.0);
+        double total = 0;
+        for (int j=firstPixel; j<endPixel; ++j) {
+            double weight;
+            if (filter == LANCZOS_FILTER) {
+                weight = lanczosWeight((j + 0.5 - (start + (i + 0.5) * ratio)) / scale);
+            }
+            else {
+                weight = min(right, j + 1.0) - max(left, (double)j);
+            }
+            sums[i][min(max(j, 0), sourceSize - 1) - lows[i]] += weight;
+            total += weight;
+        }
+        for (size_t j=0; j<sums[i].size(); ++j) {
+            sums[i][j] /= total;
+        }
+        axis.taps = max(axis.taps, (int)sums[i].size());
+    }
+
+    //Every pixel gets the same number of taps, moved left where they'd run past the last pixel:
+    axis.first.resize(targetSize);
+    axis.weights.assign(targetSize * axis.taps, 0.0f);
+    for (int i=0; i<targetSize; ++i) {
+        axis.first[i] = min(lows[i], sourceSize - axis.taps);
+        for (size_t j=0; j<sums[i].size(); ++j) {
+            axis.weights[i * axis.taps + lows[i] - axis.first[i] + j] = (float)sums[i][j];
+        }
+    }
+}
+
+//The 3-lobed Lanczos kernel at "distance" pixels from the center.
+float lanczosWeight(double distance) {
+    if (distance == 0) {
+        return 1;
+    }
+    if (fabs(distance) >= 3) {
+        return 0;
+    }
+    double angle = 3.14159265358979323846 * distance;
+    return (float)(3 * sin(angle) * sin(angle / 3) / (angle * angle));
+}
+
+//Adds "count" bytes times "weight" to "sums". This is the inner loop of resampling.
+void addWeightedBytes(const BYTE *bytes, float weight, float *sums, int64_t count) {
+    int64_t i = 0;
+    #ifdef __SSE2__
+        //Widen 16 bytes at a time to 4 vectors of 4 floats:
+        const __m128 weights = _mm_set1_ps(weight);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(bytes + i));
+            __m128i low = _mm_unpacklo_epi8(chunk, zero), high = _mm_unpackhi_epi8(chunk, zero);
+            __m128i parts[4] = {_mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+                                _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero)};
+            for (int j=0; j<4; ++j) {
+                __m128 sum = _mm_loadu_ps(sums + i + j * 4);
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(parts[j]), weights));
+                _mm_storeu_ps(sums + i + j * 4, sum);
+            }
+        }
+    #endif
+    for (; i<count; ++i) {
+        sums[i] += bytes[i] * weight;
+    }
+}
+
+//Lets the OS drop the mapped pages holding columns left of "endColumn", which have already been converted.
+void Converter::releasePixels(int64_t endColumn) {
+    #ifndef __WIN32__
+        if (mapping == NULL) {
+            return; //Pixels in memory belong to the caller
+        }
+        int64_t pageSize = sysconf(_SC_PAGESIZE);
+        int64_t stride = rowStride < 0 ? -rowStride : rowStride;
+        if (frameStride != 0) {
+            if (frameStride != rowStride * bih.biHeight) {
+                return; //Only every few frames are read
+            }
+            //The rows of a vertical strip's frames follow each other, so the frames behind us are one range:
+            int64_t rows = min(endColumn, (int64_t)bih.biWidth) / frameWidth() * bih.biHeight;
+            if (rows == 0) {
+                return;
+            }
+            const BYTE *lastRow = topRow + (rows - 1) * rowStride;
+            int64_t start = min(topRow, lastRow) - mapping, end = max(topRow, lastRow) - mapping + stride;
+            start = (start + pageSize - 1) / pageSize * pageSize;
+            end = end / pageSize * pageSize;
+            if (end > start) {
+                madvise((void *)(mapping + start), end - start, MADV_DONTNEED);
+            }
+            return;
+        }
+        //Only worth the system calls once a whole page of every row is behind us:
+        if (endColumn * 3 < pageSize) {
+            return;
+        }
+        const BYTE *pixelStart = rowStride < 0 ? topRow + rowStride * (bih.biHeight - 1) : topRow;
+        for (int64_t row=0; row<bih.biHeight; ++row) {
+            int64_t start = (pixelStart - mapping) + row * stride;
+            int64_t end = start + endColumn * 3;
+            if (endColumn >= bih.biWidth) {
+                end = start + stride;
+            }
+            start = (start + pageSize - 1) / pageSize * pageSize;
+            end = end / pageSize * pageSize;
+            if (end > start) {
+                madvise((void *)(mapping + start), end - start, MADV_DONTNEED);
+            }
+        }
+    #endif
+}
+
+//Reads the header of a Y4M stream: its frame size, chroma subsampling and, from ffmpeg's XCOLORRANGE tag,
+//whether its samples use the full range. Returns false if it isn't an 8-bit Y4M stream.
+bool readStreamHeader(FrameStream &input) {
+    string header;
+    for (int c = fgetc(input.file); c != '\n'; c = fgetc(input.file)) {
+        if (c == EOF || header.size() > 4096) {
+            return false;
+        }
+        header += (char)c;
+    }
+    stringstream fields(header);
+    string field;
+    fields >> field;
+    if (field != "YUV4MPEG2") {
+        return false;
+    }
+    input.format = Y4M_420_STREAM;
+    input.width = input.height = 0;
+    while (fields >> field) {
+        if (field[0] == 'W') {
+            input.width = atoi(field.c_str() + 1);
+        }
+        else if (field[0] == 'H') {
+            input.height = atoi(field.c_str() + 1);
+        }
+        else if (field[0] == 'C') {
+            string chroma = field.substr(1);
+            if (chroma == "420" || chroma == "420jpeg" || chroma == "420paldv" || chroma == "420mpeg2") {
+                input.format = Y4M_420_STREAM;
+            }
+            else if (chroma == "422") {
+                input.format = Y4M_422_STREAM;
+            }
+            else if (chroma == "444") {
+                input.format = Y4M_444_STREAM;
+            }
+            else if (chroma == "mono") {
+                input.format = Y4M_MONO_STREAM;
+            }
+            else {
+                return false; //Samples of more than 8 bits, or with alpha
+            }
+        }
+        else if (field == "XCOLORRANGE=FULL") {
+            input.fullRange = true;
+        }
+    }
+    if (input.width <= 0 || input.height <= 0 || input.width > 16384 || input.height > 16384) {
+        return false;
+    }
+    int64_t luma = (int64_t)input.width * input.height;
+    int64_t chromaWidth = (input.width + 1) / 2, chromaHeight = (input.height + 1) / 2;
+    input.frameBytes = input.format == Y4M_420_STREAM ? luma + 2 * chromaWidth * chromaHeight :
+                       input.format == Y4M_422_STREAM ? luma + 2 * chromaWidth * input.height :
+                       input.format == Y4M_444_STREAM ? luma * 3 : luma;
+    return true;
+}
+
+//Reads the next frame's samples into "raw". Returns false at the end of the stream.
+bool readStreamFrame(FrameStream &input, BYTE *raw) {
+    if (input.format != RAW_RGB_STREAM) {
+        //Each Y4M frame starts with a FRAME line, which may have parameters:
+        char tag[5];
+        if (fread(tag, 1, 5, input.file) != 5 || memcmp(tag, "FRAME", 5) != 0) {
+            return false;
+        }
+        for (int c = fgetc(input.file); c != '\n'; c = fgetc(input.file)) {
+            if (c == EOF) {
+                return false;
+            }
+        }
+    }
+    if (fread(raw, 1, input.frameBytes, input.file) != (size_t)input.frameBytes) {
+        return false;
+    }
+    ++input.nextFrame;
+    return true;
+}
+
+//Converts a frame's samples into 24-bit BGR "pixels", "stride" bytes from one row to the next. Y4M frames
+//are converted with the BT.601 matrix.
+void streamFrameToBGR(const FrameStream &input, const BYTE *raw, BYTE *pixels, int64_t stride) {
+    int width = input.width, height = input.height;
+    if (input.format == RAW_RGB_STREAM) {
+        for (int row=0; row<height; ++row) {
+            const BYTE *in = raw + (int64_t)row * width * 3;
+            BYTE *out = pixels + row * stride;
+            for (int column=0; column<width; ++column) {
+                out[column * 3] = in[column * 3 + 2];
+                out[column * 3 + 1] = in[column * 3 + 1];
+                out[column * 3 + 2] = in[column * 3];
+            }
+        }
+        return;
+    }
+
+    //Chroma planes follow the luma plane, at half the width for 4:2:2 and 4:2:0 and half the height for 4:2:0:
+    int chromaWidth = input.format == Y4M_444_STREAM ? width : (width + 1) / 2;
+    int chromaHeight = input.format == Y4M_420_STREAM ? (height + 1) / 2 : height;
+    int columnShift = input.format == Y4M_444_STREAM ? 0 : 1;
+    int rowShift = input.format == Y4M_420_STREAM ? 1 : 0;
+    const BYTE *lumaPlane = raw;
+    const BYTE *bluePlane = raw + (int64_t)width * height;
+    const BYTE *redPlane = bluePlane + (int64_t)chromaWidth * chromaHeight;
+
+    //Fixed point coefficients, times 256:
+    int lumaScale = input.fullRange ? 256 : 298, lumaOffset = input.fullRange ? 0 : 16;
+    int redFromV = input.fullRange ? 359 : 409, greenFromU = input.fullRange ? 88 : 100;
+    int greenFromV = input.fullRange ? 183 : 208, blueFromU = input.fullRange ? 454 : 516;
+    for (int row=0; row<height; ++row) {
+        const BYTE *luma = lumaPlane + (int64_t)row * width;
+        int64_t chromaRow = (int64_t)(row >> rowShift) * chromaWidth;
+        BYTE *out = pixels + row * stride;
+        for (int column=0; column<width; ++column) {
+            int y = (luma[column] - lumaOffset) * lumaScale + 128;
+            int u = 0, v = 0;
+            if (input.format != Y4M_MONO_STREAM) {
+                u = bluePlane[chromaRow + (column >> columnShift)] - 128;
+                v = redPlane[chromaRow + (column >> columnShift)] - 128;
+            }
+            out[column * 3] = (BYTE)min(max((y + blueFromU * u) >> 8, 0), 255);
+            out[column * 3 + 1] = (BYTE)min(max((y - greenFromU * u - greenFromV * v) >> 8, 0), 255);
+            out[column * 3 + 2] = (BYTE)min(max((y + redFromV * v) >> 8, 0), 255);
+        }
+    }
+}
+
+//File position of "file", or -1 if it isn't a file that can be moved back in, such as a pipe.
+int64_t tellStream(FILE *file) {
+    #ifdef __WIN32__
+        return _ftelli64(file);
+    #else
+        return ftello(file);
+    #endif
+}
+
+bool seekStream(FILE *file, int64_t position) {
+    #ifdef __WIN32__
+        return _fseeki64(file, position, SEEK_SET) == 0;
+    #else
+        return fseeko(file, position, SEEK_SET) == 0;
+    #endif
+}
+
+//Generates and saves DCPU code from the mapped bitmap. Returns false if the file can't be written.
+bool Converter::saveFile(const char *filename) {
+
+    if (!openOutput(filename)) { //Open file for writing (overwrites file)
+        return false;
+    }
+
+    if (imageMode == HIGH_RES_SMALL) {
+        generateDCPUSmall();
+    }
+    else {
+        generateDCPUFull();
+    }
+
+    flushCacheStats();
+    return closeOutput(filename); //Flush and close the file
+}
+
+//Generates the DCPU code as saveFile() does, but writes it to "out". Binary output has no symbol map here.
+//Returns false if the stream fails or the program can't be assembled.
+bool Converter::saveStream(ostream &out) {
+    if (options.outputFormat != TEXT_OUTPUT) {
+        vector<WORD> program;
+        if (!assembleProgram(program)) {
+            return false;
+        }
+        for (uint32_t i=0; i<wordAddress; ++i) {
+            if (options.outputFormat == BINARY_BIG_ENDIAN) {
+                out.put(program[i] >> 8).put(program[i] & 0xFF);
+            }
+            else {
+                out.put(program[i] & 0xFF).put(program[i] >> 8);
+            }
+        }
+        return out.good();
+    }
+
+    outputUsed = 0;
+    outputFailed = false;
+    outputStream = &out;
+    if (imageMode == HIGH_RES_SMALL) {
+        generateDCPUSmall();
+    }
+    else {
+        generateDCPUFull();
+    }
+    flushOutput();
+    outputStream = NULL;
+    return !outputFailed;
+}
+
+//Converts the image again after it has changed, taking every frame whose pixels are the same from the frame
+//cache. When the mode, frame count and palette are unchanged and the frames are stored in full, only the words
+//of the changed frames are rewritten in place in "outputFilename", and "patched" is set; otherwise the whole
+//file is saved again. Returns the number of frames that were converted, or -1 if the image can't be read, has
+//an unsupported size, or the output can't be written.
+int64_t Converter::updateFile(const char *imageFilename, const char *outputFilename, bool &patched) {
+    int previousMode = imageMode;
+    int64_t previousFrames = frameKeys.size() / 2;
+    patched = false;
+    cacheFrames = true;
+    convertedFrames = 0;
+    stringstream log;
+    if (!readImage(imageFilename) || selectImageMode(log) != 0) {
+        closeImage();
+        return -1;
+    }
+    int64_t frames = bih.biWidth / frameWidth();
+    paletteSeconds = tileSeconds = writeSeconds = 0;
+
+    bool patch = frameDataOffset >= 0 && imageMode == previousMode && frames == previousFrames;
+    if (patch && imageMode == LOW_RES_FULL) {
+        //Every tile holds palette indices, so a new palette means new words for every frame:
+        generateColorPalette();
+        patch = memcmp(cachePalette, currentPalette, sizeof(cachePalette)) == 0;
+    }
+    if (!patch) {
+        bool saved = saveFile(outputFilename);
+        closeImage();
+        return saved ? convertedFrames : -1;
+    }
+
+    //Find the frames whose pixels changed, and convert them into the cache:
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int wordCount = frameWordCount();
+    vector<uint64_t> keys(frames * 2);
+    runWorkers(frames, [&](size_t frame) {
+        frameCacheKey(frame, &keys[frame * 2]);
+    });
+    vector<int64_t> changed;
+    for (int64_t x=0; x<frames; ++x) {
+        if (!frameCached[x] || frameKeys[x * 2] != keys[x * 2] || frameKeys[x * 2 + 1] != keys[x * 2 + 1]) {
+            changed.push_back(x);
+        }
+    }
+    atomic<int64_t> converted(0);
+    runWorkers(changed.size(), [&](size_t i) {
+        int64_t x = changed[i];
+        converted += convertCachedFrame(x, &frameCache[x * wordCount]);
+        frameKeys[x * 2] = keys[x * 2];
+        frameKeys[x * 2 + 1] = keys[x * 2 + 1];
+        frameCached[x] = true;
+    });
+    convertedFrames = converted;
+    tileSeconds += secondsSince(start);
+    closeImage();
+    flushCacheStats();
+
+    //Rewrite the words of each changed frame where they are, formatted as emitWord() writes them:
+    static const char hexDigits[] = "0123456789abcdef";
+    int wordBytes = options.outputFormat == TEXT_OUTPUT ? 8 : 2;
+    #ifdef __WIN32__
+        HANDLE file = CreateFile(outputFilename,GENERIC_WRITE,0,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return -1;
+        }
+    #else
+        HANDLE file = open(outputFilename, O_WRONLY);
+        if (file < 0) {
+            return -1;
+        }
+    #endif
+    bool written = true;
+    vector<char> bytes(wordCount * wordBytes);
+    for (size_t i=0; i<changed.size() && written; ++i) {
+        const WORD *words = &frameCache[changed[i] * wordCount];
+        char *out = &bytes[0];
+        for (int j=0; j<wordCount; ++j) {
+            WORD word = words[j];
+            if (options.outputFormat == TEXT_OUTPUT) {
+                out[0] = '0';
+                out[1] = 'x';
+                out[2] = hexDigits[(word >> 12) & 0xF];
+                out[3] = hexDigits[(word >> 8) & 0xF];
+                out[4] = hexDigits[(word >> 4) & 0xF];
+                out[5] = hexDigits[word & 0xF];
+                out[6] = ',';
+                out[7] = ' ';
+            }
+            else if (options.outputFormat == BINARY_BIG_ENDIAN) {
+                out[0] = word >> 8;
+                out[1] = word & 0xFF;
+            }
+            else {
+                out[0] = word & 0xFF;
+                out[1] = word >> 8;
+            }
+            out += wordBytes;
+        }
+        int64_t offset = frameDataOffset + changed[i] * wordCount * wordBytes;
+        #ifdef __WIN32__
+            LARGE_INTEGER position;
+            position.QuadPart = offset;
+            DWORD count = 0;
+            written = SetFilePointerEx(file,position,NULL,FILE_BEGIN) &&
+                      WriteFile(file,&bytes[0],bytes.size(),&count,NULL) && count == bytes.size();
+        #else
+            written = pwrite(file, &bytes[0], bytes.size(), offset) == (ssize_t)bytes.size();
+        #endif
+    }
+    #ifdef __WIN32__
+        CloseHandle(file);
+    #else
+        if (close(file) != 0) {
+            written = false;
+        }
+    #endif
+    patched = true;
+    return written ? convertedFrames : -1;
+}
+
+void Converter::generateDCPUFull() {
+    int64_t frames = frameCount();
+    generateColorPalette();
+    setupMonitor();
+
+    //Set up the DCPU custom font:
+    emitText("SET B, font_space\n"
+             "SET A, 1\n"
+             "HWI [monitor]\n\n");
+
+    //Set up the DCPU custom color palette:
+    emitText("SET B, palette_space\n"
+             "SET A, 2\n"
+             "HWI [monitor]\n\n");
+
+    emitText("SET A, 0\n"
+             "SET B, tile_space\n"
+             "HWI [monitor]\n\n");
+
+    if (options.packingCodec != NO_CODEC) {
+        emitCodecPlayer("tile_space", 0);
+    }
+    else if (animationFlag == true && options.deltaEncoding) {
+        emitDeltaPlayer("tile_space");
+    }
+    else if (animationFlag == true && options.frameDedup) {
+        emitIndexedPlayer("tile_space");
+    }
+    else if (animationFlag == true) {
+        emitText(":frame_loop\n"
+                 "IFE B, exit\n"
+                 "SET B, tile_space\n"
+                 "HWI [monitor]\n"
+                 "JSR delay\n"
+                 "ADD B, 0x0180\n"
+                 "SET PC, frame_loop\n\n");
+        emitDelay();
+    }
+
+    if (animationFlag == false && options.packingCodec == NO_CODEC) {
+        emitText("BRK\n");
+    }
+
+    emitText(":font_space DAT ");
+    genFontSpace(imageMode); //Set up custom font
+    emitText("\n");
+    if (imageMode == LOW_RES_FULL) {
+        emitText(":palette_space DAT ");
+        genPaletteSpace();
+    }
+    else if (imageMode == HIGH_RES_FULL) {
+        emitText(":palette_space DAT 0x0000, 0x0FFF");
+    }
+
+    if (options.packingCodec != NO_CODEC) {
+        emitText("\n:packed_space DAT ");
+        emitPackedFrames(frames);
+    }
+    else {
+        emitText("\n:tile_space DAT ");
+        if (animationFlag == true && options.deltaEncoding) {
+            emitDeltaFrames(frames);
+        }
+        else if (animationFlag == true && options.frameDedup) {
+            emitUniqueFrames(frames);
+        }
+        else {
+            emitFrames(frames);
+        }
+    }
+    emitText("\n:exit dat 0\n"
+             ":monitor dat 0\n"
+             ":not_found SET PC, 0\n");
+    if (options.packingCodec != NO_CODEC) {
+        emitText(":tile_space\n"); //Frames are unpacked into the free memory after the program
+    }
+}
+
+void Converter::setupMonitor() {
+    emitText("HWN Z\n"
+             ":get_monitor\n"
+             "IFE Z, 0\n"
+             "SET PC, not_found\n"
+             "SUB Z, 1\n"
+             "HWQ Z\n"
+             "IFN A, 0xF615\n"
+             "SET PC, get_monitor\n"
+             "SET [monitor], Z\n\n");
+
+    //Timed animations also find the generic clock, set it to 60 ticks per second and take its interrupts:
+    if (animationFlag == true && options.framesPerSecond > 0) {
+        emitText("HWN Z\n"
+                 ":get_clock\n"
+                 "IFE Z, 0\n"
+                 "SET PC, not_found\n"
+                 "SUB Z, 1\n"
+                 "HWQ Z\n"
+                 "IFN A, 0xB402\n"
+                 "SET PC, get_clock\n"
+                 "IFN B, 0x12D0\n"
+                 "SET PC, get_clock\n"
+                 "SET [clock], Z\n"
+                 "IAS clock_tick\n"
+                 "SET A, 0\n"
+                 "SET B, 1\n"
+                 "HWI [clock]\n"
+                 "SET A, 2\n"
+                 "SET B, 1\n"
+                 "HWI [clock]\n\n");
+    }
+}
+
+//The wait between animation frames: a busy-wait, or with --fps, waiting for the clock interrupt handler to
+//count down the frame's hold time in 1/60 second ticks. The DCPU has no halt instruction, so the player
+//waits in a two-instruction loop on frame_due while the handler does the timing.
+void Converter::emitDelay() {
+    if (options.framesPerSecond <= 0) {
+        //Animations with dropped frames wait as much longer for each frame that's left:
+        stringstream delay;
+        delay << ":delay\n"
+                 "SET X, 0\n"
+                 ":loop\n"
+                 "ADD X, 1\n"
+                 "IFN X, " << 1000 * frameStep << "\n"
+                 "SET PC, loop\n"
+                 "SET PC, POP\n";
+        emitText(delay.str().c_str());
+        return;
+    }
+
+    //Holds are only stored per frame when they aren't all the same, which selectStreamMode() makes sure of
+    //for streams:
+    int64_t frames = frameCount();
+    bool sameHolds = true;
+    for (int64_t x=1; x<frames && sameHolds && stream == NULL; ++x) {
+        sameHolds = frameHold(x) == frameHold(0);
+    }
+
+    stringstream delay;
+    delay << ":delay\n"
+             "IFE [frame_due], 0\n"
+             "SET PC, delay\n"
+             "SET [frame_due], 0\n";
+    if (sameHolds) {
+        delay << "SET [hold_left], " << frameHold(0) << "\n";
+    }
+    else {
+        delay << "ADD [frame_index], 1\n"
+                 "IFE [frame_index], " << frames << "\n"
+                 "SET [frame_index], 0\n"
+                 "SET PUSH, A\n"
+                 "SET A, [frame_index]\n"
+                 "ADD A, hold_table\n"
+                 "SET [hold_left], [A]\n"
+                 "SET A, POP\n";
+    }
+    delay << "SET PC, POP\n"
+             ":clock_tick\n"
+             "IFE [hold_left], 0\n"
+             "RFI 0\n"
+             "SUB [hold_left], 1\n"
+             "IFE [hold_left], 0\n"
+             "SET [frame_due], 1\n"
+             "RFI 0\n"
+             ":clock dat 0\n"
+             ":frame_due dat 0\n"
+             ":frame_index dat 0\n"
+             ":hold_left dat " << frameHold(0) << "\n";
+    emitText(delay.str().c_str());
+    if (!sameHolds) {
+        emitText(":hold_table DAT ");
+        for (int64_t x=0; x<frames; ++x) {
+            emitWord(frameHold(x));
+        }
+        emitText("\n");
+    }
+}
+
+//Number of 1/60 second clock ticks that frame "x" stays on screen. Frame rates that don't divide 60 get
+//holds that alternate so that the average rate is exact.
+int Converter::frameHold(int64_t x) {
+    map<int64_t, int>::iterator hold = options.frameHoldMs.find(x);
+    if (hold != options.frameHoldMs.end()) {
+        return max(1, (int)floor(hold->second * 60 / 1000.0 + 0.5));
+    }
+    int64_t start = (int64_t)floor(x * 60 / options.framesPerSecond + 0.5);
+    int64_t end = (int64_t)floor((x + 1) * 60 / options.framesPerSecond + 0.5);
+    return max((int64_t)1, end - start);
+}
+
+void Converter::generateDCPUSmall() {
+    int64_t frames = frameCount();
+    setupMonitor();
+
+    //Set up the DCPU custom font:
+    emitText("SET B, tile_space\n"
+             "SET A, 0\n"
+             "HWI [monitor]\n\n");
+
+    //Set up the DCPU custom color palette:
+    emitText("SET B, palette_space\n"
+             "SET A, 2\n"
+             "HWI [monitor]\n\n");
+
+    emitText("SET A, 1\n"
+             "SET B, font_space\n"
+             "HWI [monitor]\n\n");
+
+    if (options.packingCodec != NO_CODEC) {
+        emitCodecPlayer("font_space", 1);
+    }
+    else if (animationFlag == true && options.glyphDictionary) {
+        emitGlyphPlayer();
+    }
+    else if (animationFlag == true && options.deltaEncoding) {
+        emitDeltaPlayer("font_space");
+    }
+    else if (animationFlag == true && options.frameDedup) {
+        emitIndexedPlayer("font_space");
+    }
+    else if (animationFlag == true) {
+        emitText(":frame_loop\n"
+                 "IFE B, exit\n"
+                 "SET B, font_space\n"
+                 "HWI [monitor]\n"
+                 "JSR delay\n"
+                 "ADD B, 256\n"
+                 "SET PC, frame_loop\n\n");
+        emitDelay();
+    }
+
+    if (animationFlag == false && options.packingCodec == NO_CODEC) {
+        emitText("BRK\n");
+    }
+
+    emitText(":palette_space DAT 0x0000, 0x0FFF");
+
+    emitText("\n:tile_space DAT ");
+    genFontSpace(imageMode); //Set up custom font
+
+    if (options.packingCodec != NO_CODEC) {
+        emitText("\n:packed_space DAT ");
+        emitPackedFrames(frames);
+    }
+    else {
+        emitText("\n:font_space DAT ");
+        if (animationFlag == true && options.glyphDictionary) {
+            emitGlyphFrames(frames);
+        }
+        else if (animationFlag == true && options.deltaEncoding) {
+            emitDeltaFrames(frames);
+        }
+        else if (animationFlag == true && options.frameDedup) {
+            emitUniqueFrames(frames);
+        }
+        else {
+            emitFrames(frames);
+        }
+    }
+
+    emitText("\n:exit dat 0\n"
+             ":monitor dat 0\n"
+             ":not_found SET PC, 0\n");
+    if (options.packingCodec != NO_CODEC) {
+        emitText(":font_space\n"); //Frames are unpacked into the free memory after the program
+    }
+}
+
+//Width in pixels of one frame of the current mode.
+int Converter::frameWidth() {
+    if (imageMode == LOW_RES_FULL) {
+        return LOW_RES_FULL_W;
+    }
+    else if (imageMode == HIGH_RES_FULL) {
+        return HIGH_RES_FULL_W;
+    }
+    return HIGH_RES_SMALL_W;
+}
+
+//Number of words in one converted frame: a screen map for the full screen modes, a font for the centered one.
+int Converter::frameWordCount() {
+    return imageMode == HIGH_RES_SMALL ? 256 : 0x180;
+}
+
+//Number of frames in the image. A stream's frames are only counted as they're read, so until then it has no end.
+int64_t Converter::frameCount() {
+    return stream != NULL ? INT64_MAX : bih.biWidth / frameWidth();
+}
+
+//Makes frames "first" to "first" + "count" - 1 readable through pixel(), reading them from the stream if they
+//aren't loaded yet. Loaded frames from "first" on are kept, and those before it are dropped; going back to an
+//earlier frame reads the stream again from the start. Returns how many of the frames there are, which is fewer
+//than "count" at the end of the image or stream.
+int64_t Converter::loadFrames(int64_t first, int64_t count) {
+    int width = frameWidth();
+    if (stream == NULL) {
+        return max((int64_t)0, min(count, bih.biWidth / width - first));
+    }
+    FrameStream &input = *stream;
+    int64_t loadedFirst = firstColumn / width, loadedEnd = bih.biWidth / width;
+    if (first < loadedFirst) {
+        if (input.dataStart < 0 || !seekStream(input.file, input.dataStart)) {
+            return 0;
+        }
+        input.nextFrame = 0;
+        input.ended = false;
+        loadedFirst = loadedEnd = 0;
+    }
+    int64_t end = max(first + count, loadedEnd);
+    if (end <= loadedEnd && first >= loadedFirst) {
+        if (first > loadedFirst) {
+            //Drop the frames before "first" by moving the start of the window along:
+            topRow += (first - loadedFirst) * frameStride;
+            firstColumn = first * width;
+        }
+        return min(count, loadedEnd - first);
+    }
+
+    //Frames that are kept move into a new window, and the rest are read after them, one after another. The
+    //frames are converted and resampled on the workers a batch at a time, as many as fit in 32 MB (or one frame):
+    int64_t frameBytes = (int64_t)width * bih.biHeight * 3;
+    vector<BYTE> window((end - first) * frameBytes, 0);
+    int64_t keptFirst = max(first, loadedFirst), kept = max((int64_t)0, loadedEnd - keptFirst);
+    if (kept > 0) {
+        memcpy(&window[(keptFirst - first) * frameBytes], frameTop(keptFirst, width), kept * frameBytes);
+    }
+    int64_t next = keptFirst + kept;
+    while (input.nextFrame < first && !input.ended) {
+        input.raw.resize(input.frameBytes);
+        input.ended = !readStreamFrame(input, &input.raw[0]); //Skipped frames are read and dropped
+    }
+    next = max(next, input.nextFrame);
+    int64_t batchLimit = max((int64_t)1, ((int64_t)32 << 20) / input.frameBytes);
+    while (next < end && !input.ended) {
+        int64_t batch = min(end - next, batchLimit), read = 0;
+        input.raw.resize(batch * input.frameBytes);
+        while (read < batch && readStreamFrame(input, &input.raw[read * input.frameBytes])) {
+            ++read;
+        }
+        input.ended = read < batch;
+        runWorkers(read, [&](size_t frame) {
+            const BYTE *raw = &input.raw[frame * input.frameBytes];
+            BYTE *target = &window[(next - first + frame) * frameBytes];
+            if (!input.resample) {
+                streamFrameToBGR(input, raw, target, width * 3);
+                return;
+            }
+            vector<BYTE> pixels((int64_t)input.width * input.height * 3);
+            streamFrameToBGR(input, raw, &pixels[0], input.width * 3);
+            resampleFrame(input.fit, &pixels[0], input.width * 3, target, width * 3);
+        });
+        next += read;
+    }
+    vector<BYTE>().swap(input.raw);
+    streamFrames = max(streamFrames, input.nextFrame);
+
+    input.window.swap(window);
+    setFrameLayout(input.window.empty() ? NULL : &input.window[0], width, width * 3, frameBytes);
+    firstColumn = first * width;
+    bih.biWidth = next * width;
+    return max((int64_t)0, min(count, next - first));
+}
+
+//Converts frame "x" of the bitmap into its DCPU words. Frames only read their own pixels and the palette, so
+//any number of them can be converted at once.
+void Converter::convertFrame(int64_t x, WORD *words) {
+    int width = frameWidth();
+    //Calculate the DCPU code for each "pixel" (tile)
+    if (imageMode == LOW_RES_FULL && options.fullPrecision) {
+        //Skip every other row, because we take 2 at a time.
+        for (int i=0; i<bih.biHeight - 1; i+=2) {
+            for (int j=0; j<width; ++j) {
+                int64_t column = j + (x * width); //Column of pixel in BMP
+                *words++ = generateLowResTile(pixel(column, i), pixel(column, i+1));
+            }
+        }
+    }
+    else if (imageMode == LOW_RES_FULL) {
+        //Tiles are made from the frame's 12-bit colors, kept from counting them or quantized again here:
+        WORD quantized[LOW_RES_FULL_W * LOW_RES_FULL_H];
+        const WORD *colors = quantized;
+        if (x < quantizedFrames) {
+            colors = &quantizedColors[x * LOW_RES_FULL_W * LOW_RES_FULL_H];
+        }
+        else {
+            quantizeFrame(x, quantized);
+        }
+        for (int i=0; i<LOW_RES_FULL_H - 1; i+=2) {
+            for (int j=0; j<width; ++j) {
+                *words++ = paletteLookup[colors[i * width + j]] * 4096 + paletteLookup[colors[(i + 1) * width + j]] * 256;
+            }
+        }
+    }
+    else {
+        //The black and white modes read the frame once, into a plane of black pixels:
+        uint64_t plane[HIGH_RES_SMALL_H];
+        thresholdFrame(x, plane);
+        if (imageMode == HIGH_RES_FULL) {
+            for (int i=0; i<bih.biHeight - 3; i+=4) {
+                for (int j=0; j<width - 1; j+=2) {
+                    //Analyze tile:
+                    *words++ = generateHighResFullTile(plane, j, i);
+                }
+            }
+        }
+        else {
+            for (int i=0; i<bih.biHeight - 7; i+=8) {
+                for (int j=0; j<width - 3; j+=4) {
+                    //Analyze tile:
+                    generateHighResSmallTile(plane, j, i, words);
+                    words += 2;
+                }
+            }
+        }
+    }
+}
+
+//Thresholds frame "x" of a black and white mode into "plane": one 64-bit word per row, with bit n set where
+//pixel n rounds to the 12-bit color 0x000, which is when all three of its channels are below 8.
+void Converter::thresholdFrame(int64_t x, uint64_t *plane) {
+    for (int64_t row=0; row<bih.biHeight; ++row) {
+        const BYTE *bytes = (const BYTE *)&pixel(x * HIGH_RES_FULL_W, row);
+        uint64_t black = 0;
+        #ifdef __SSE2__
+            //Flag every byte below 8, 16 pixels (48 bytes) at a time, and keep the pixels with all three
+            //bytes flagged:
+            const __m128i highBits = _mm_set1_epi8((char)0xF8);
+            const __m128i zero = _mm_setzero_si128();
+            for (int group=0; group<4; ++group) {
+                uint64_t flags = 0;
+                for (int i=0; i<3; ++i) {
+                    __m128i chunk = _mm_loadu_si128((const __m128i *)(bytes + group * 48 + i * 16));
+                    uint32_t small = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(chunk, highBits), zero));
+                    flags |= (uint64_t)small << (i * 16);
+                }
+                flags &= (flags >> 1) & (flags >> 2);
+                for (int i=0; i<4; ++i) {
+                    black |= (uint64_t)bitPlaneTables.everyThirdBit[(flags >> (i * 12)) & 0xFFF] << (group * 16 + i * 4);
+                }
+            }
+        #else
+            for (int i=0; i<HIGH_RES_FULL_W; ++i) {
+                black |= (uint64_t)((bytes[i * 3] | bytes[i * 3 + 1] | bytes[i * 3 + 2]) < 8) << i;
+            }
+        #endif
+        plane[row] = black;
+    }
+}
+
+//Quantizes frame "x" to the 12-bit color of each pixel, row by row from the top.
+void Converter::quantizeFrame(int64_t x, WORD *colors) {
+    int width = frameWidth();
+    for (int64_t row=0; row<bih.biHeight; ++row) {
+        quantizeColors((const BYTE *)&pixel(x * width, row), width, colors + row * width);
+    }
+}
+
+//Converts "count" frames from frame "first" into "words", one after another. The frames are shared out
+//between the worker threads as each one finishes its last, and every frame has its own place in "words",
+//so the result is the same as converting them in order.
+void Converter::convertFrames(int64_t first, int64_t count, WORD *words) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int wordCount = frameWordCount();
+    atomic<int64_t> converted(0);
+    if (cacheFrames) {
+        prepareFrameCache(bih.biWidth / frameWidth());
+    }
+    runWorkers(count, [&](size_t frame) {
+        int64_t x = first + frame;
+        if (!cacheFrames) {
+            converted += convertCachedFrame(x, words + frame * wordCount);
+            return;
+        }
+        //The 128-bit cache key stands in for the pixels of the last version of the image, as it does in the
+        //cache directory:
+        uint64_t key[2];
+        frameCacheKey(x, key);
+        WORD *cached = &frameCache[x * wordCount];
+        uint64_t *cachedKey = &frameKeys[x * 2];
+        if (!frameCached[x] || cachedKey[0] != key[0] || cachedKey[1] != key[1]) {
+            converted += convertCachedFrame(x, cached);
+            cachedKey[0] = key[0];
+            cachedKey[1] = key[1];
+            frameCached[x] = true;
+        }
+        copy(cached, cached + wordCount, words + frame * wordCount);
+    });
+    convertedFrames += converted;
+    releasePixels((first + count) * frameWidth());
+    tileSeconds += secondsSince(start);
+}
+
+//Empties the frame cache unless it was filled for the current mode, frame count and palette.
+void Converter::prepareFrameCache(int64_t frames) {
+    if (cacheMode == imageMode && (int64_t)frameKeys.size() == frames * 2 &&
+        memcmp(cachePalette, currentPalette, sizeof(cachePalette)) == 0) {
+        return;
+    }
+    cacheMode = imageMode;
+    memcpy(cachePalette, currentPalette, sizeof(cachePalette));
+    frameCache.assign(frames * frameWordCount(), 0);
+    frameKeys.assign(frames * 2, 0);
+    frameCached.assign(frames, false);
+}
+
+//Number of frames the frame loops convert at a time: enough to give every worker a long run of frames, while
+//holding no more than about 4 MB of words. Streams hold fewer, as their pixels are loaded for each window too.
+int64_t Converter::frameWindow() {
+    if (stream != NULL) {
+        return max((int64_t)workerCount() * 16, (int64_t)256);
+    }
+    return max((int64_t)workerCount() * 16, (int64_t)(1 << 21) / frameWordCount());
+}
+
+//Threads to split the work of one conversion across.
+unsigned int Converter::workerCount() {
+    return options.workerThreads != 0 ? options.workerThreads : defaultThreadCount();
+}
+
+//Runs job(0) to job(jobCount - 1) on the worker threads, or on this one when there's only one worker.
+void Converter::runWorkers(size_t jobCount, const function<void(size_t)> &job) {
+    runOnPool(jobCount, min((size_t)workerCount(), jobCount), job);
+}
+
+//Converts frame "x" into "words", or loads its words from the cache directory when they're there. Returns
+//true if the frame had to be converted.
+bool Converter::convertCachedFrame(int64_t x, WORD *words) {
+    if (options.cacheDir.empty()) {
+        convertFrame(x, words);
+        return true;
+    }
+    uint64_t key[2];
+    frameCacheKey(x, key);
+    char name[48];
+    snprintf(name, sizeof(name), "/%02x/%016llx%016llx", (int)(key[0] >> 56), (unsigned long long)key[0],
+             (unsigned long long)key[1]);
+    string path = options.cacheDir + name;
+    int wordCount = frameWordCount();
+    if (readCacheEntry(path, key, words, wordCount)) {
+        ++cacheHits;
+        return false;
+    }
+    convertFrame(x, words);
+    ++cacheMisses;
+    cacheBytesAdded += writeCacheEntry(options.cacheDir, path, key, words, wordCount);
+    return true;
+}
+
+//The cache key of frame "x": two 64-bit hashes, with different seeds, of its pixels, the mode and, for full
+//color, the palette and the way colors are matched to it.
+void Converter::frameCacheKey(int64_t x, uint64_t key[2]) {
+    int settings[4 + 16 * 3] = {(int)CACHE_VERSION, imageMode};
+    if (imageMode == LOW_RES_FULL) {
+        settings[2] = options.colorMetric;
+        settings[3] = options.fullPrecision;
+        memcpy(settings + 4, currentPalette, sizeof(currentPalette));
+    }
+    key[0] = hashBytes(settings, sizeof(settings), 14695981039346656037ULL);
+    key[1] = hashBytes(settings, sizeof(settings), 0x6A09E667F3BCC908ULL);
+    int width = frameWidth();
+    for (int64_t row=0; row<bih.biHeight; ++row) {
+        key[0] = hashBytes(&pixel(x * width, row), width * 3, key[0]);
+        key[1] = hashBytes(&pixel(x * width, row), width * 3, key[1]);
+    }
+}
+
+//Adds the hits, misses and bytes since the last call to the cache directory's totals, trimming it if it has
+//grown too large.
+void Converter::flushCacheStats() {
+    if (options.cacheDir.empty()) {
+        return;
+    }
+    int64_t hits = cacheHits, misses = cacheMisses, bytes = cacheBytesAdded;
+    updateCacheStats(options.cacheDir, options.cacheLimitBytes, bytes - flushedBytes, hits - flushedHits,
+                     misses - flushedMisses);
+    flushedHits = hits;
+    flushedMisses = misses;
+    flushedBytes = bytes;
+}
+
+//Reads the words of a cache entry into "words". Returns false if there's no such entry, or it isn't a
+//complete entry for "key" with "count" words. A hit marks the entry as recently used.
+bool readCacheEntry(const string &path, const uint64_t key[2], WORD *words, int count) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    CacheEntryHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.magic == CACHE_MAGIC &&
+                 header.wordCount == (uint32_t)count && header.key[0] == key[0] && header.key[1] == key[1] &&
+                 fread(words, sizeof(WORD), count, file) == (size_t)count && fgetc(file) == EOF;
+    fclose(file);
+    #ifndef __WIN32__
+        if (valid) {
+            utime(path.c_str(), NULL);
+        }
+    #endif
+    return valid;
+}
+
+//Adds an entry to the cache, writing it to a temporary file that is then renamed into place, so other
+//processes only ever see whole entries. Returns the bytes added, or 0 if it couldn't be written.
+int64_t writeCacheEntry(const string &dir, const string &path, const uint64_t key[2], const WORD *words, int count) {
+    #ifdef __WIN32__
+        uint64_t processId = GetCurrentProcessId();
+    #else
+        uint64_t processId = getpid();
+    #endif
+    stringstream tempPath;
+    tempPath << path << "." << processId << "." << cacheTempCount++ << ".tmp";
+    FILE *file = fopen(tempPath.str().c_str(), "wb");
+    if (file == NULL) {
+        //The first entry of a shard creates its directory, and the cache directory too if need be:
+        string shard = path.substr(0, path.find_last_of('/'));
+        #ifdef __WIN32__
+            CreateDirectory(dir.c_str(), NULL);
+            CreateDirectory(shard.c_str(), NULL);
+        #else
+            mkdir(dir.c_str(), 0777);
+            mkdir(shard.c_str(), 0777);
+        #endif
+        file = fopen(tempPath.str().c_str(), "wb");
+        if (file == NULL) {
+            return 0;
+        }
+    }
+    CacheEntryHeader header = {CACHE_MAGIC, (uint32_t)count, {key[0], key[1]}};
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(words, sizeof(WORD), count, file) == (size_t)count;
+    written = fclose(file) == 0 && written;
+    #ifdef __WIN32__
+        written = written && MoveFileEx(tempPath.str().c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+    #else
+        written = written && rename(tempPath.str().c_str(), path.c_str()) == 0;
+    #endif
+    if (!written) {
+        remove(tempPath.str().c_str());
+        return 0;
+    }
+    return sizeof(header) + count * sizeof(WORD);
+}
+
+//Adds a conversion's bytes, hits and misses to the totals in the cache directory's "stats" file. When the
+//cache has grown past "limit" bytes, the least recently used entries are deleted until it's under 90% of it,
+//along with temporary files left behind for over an hour. The totals are updated under a lock on the "lock"
+//file; entries are only ever renamed into place or deleted, so other processes can go on reading meanwhile.
+void updateCacheStats(const string &dir, uint64_t limit, int64_t bytesAdded, int64_t hits, int64_t misses) {
+    string lockPath = dir + "/lock", statsPath = dir + "/stats";
+    #ifdef __WIN32__
+        CreateDirectory(dir.c_str(), NULL);
+        HANDLE lock = CreateFile(lockPath.c_str(),GENERIC_READ | GENERIC_WRITE,FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL,OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+        if (lock == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        OVERLAPPED overlapped = {};
+        LockFileEx(lock,LOCKFILE_EXCLUSIVE_LOCK,0,1,0,&overlapped);
+    #else
+        mkdir(dir.c_str(), 0777);
+        int lock = open(lockPath.c_str(), O_RDWR | O_CREAT, 0666);
+        if (lock < 0) {
+            return;
+        }
+        flock(lock, LOCK_EX);
+    #endif
+
+    int64_t totalBytes = 0, totalHits = 0, totalMisses = 0;
+    FILE *stats = fopen(statsPath.c_str(), "r");
+    if (stats != NULL) {
+        long long values[3];
+        if (fscanf(stats, "bytes %lld hits %lld misses %lld", &values[0], &values[1], &values[2]) == 3) {
+            totalBytes = values[0];
+            totalHits = values[1];
+            totalMisses = values[2];
+        }
+        fclose(stats);
+    }
+    totalBytes += bytesAdded;
+    totalHits += hits;
+    totalMisses += misses;
+
+    if ((uint64_t)max(totalBytes, (int64_t)0) > limit) {
+        //List every entry with the time it was last used, then delete from the oldest:
+        struct Entry {
+            int64_t time;
+            int64_t size;
+            string path;
+            bool operator<(const Entry &other) const { return time < other.time; }
+        };
+        vector<Entry> entries;
+        int64_t now = time(NULL);
+        totalBytes = 0;
+        for (int shard=0; shard<256; ++shard) {
+            char shardName[4];
+            snprintf(shardName, sizeof(shardName), "%02x", shard);
+            string shardPath = dir + "/" + shardName + "/";
+            #ifdef __WIN32__
+                WIN32_FIND_DATA found;
+                HANDLE search = FindFirstFile((shardPath + "*").c_str(), &found);
+                if (search == INVALID_HANDLE_VALUE) {
+                    continue;
+                }
+                do {
+                    if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                        continue;
+                    }
+                    //File times are in 100 ns units since 1601:
+                    int64_t written = ((int64_t)found.ftLastWriteTime.dwHighDateTime << 32 |
+                                       found.ftLastWriteTime.dwLowDateTime) / 10000000 - 11644473600LL;
+                    Entry entry = {written, (int64_t)found.nFileSizeHigh << 32 | found.nFileSizeLow,
+                                   shardPath + found.cFileName};
+                    entries.push_back(entry);
+                } while (FindNextFile(search, &found));
+                FindClose(search);
+            #else
+                DIR *directory = opendir(shardPath.c_str());
+                if (directory == NULL) {
+                    continue;
+                }
+                while (dirent *item = readdir(directory)) {
+                    struct stat info;
+                    Entry entry = {0, 0, shardPath + item->d_name};
+                    if (item->d_name[0] == '.' || stat(entry.path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+                        continue;
+                    }
+                    entry.time = info.st_mtime;
+                    entry.size = info.st_size;
+                    entries.push_back(entry);
+                }
+                closedir(directory);
+            #endif
+        }
+        for (size_t i=0; i<entries.size(); ) {
+            bool temporary = entries[i].path.size() > 4 && entries[i].path.compare(entries[i].path.size() - 4, 4, ".tmp") == 0;
+            if (temporary) {
+                if (now - entries[i].time > 3600) {
+                    remove(entries[i].path.c_str());
+                }
+                entries.erase(entries.begin() + i);
+                continue;
+            }
+            totalBytes += entries[i].size;
+            ++i;
+        }
+        sort(entries.begin(), entries.end());
+        for (size_t i=0; i<entries.size() && (uint64_t)totalBytes > limit / 10 * 9; ++i) {
+            if (remove(entries[i].path.c_str()) == 0) {
+                totalBytes -= entries[i].size;
+            }
+        }
+    }
+
+    stats = fopen(statsPath.c_str(), "w");
+    if (stats != NULL) {
+        fprintf(stats, "bytes %lld hits %lld misses %lld\n", (long long)totalBytes, (long long)totalHits,
+                (long long)totalMisses);
+        fclose(stats);
+    }
+
+    #ifdef __WIN32__
+        UnlockFileEx(lock,0,1,0,&overlapped);
+        CloseHandle(lock);
+    #else
+        flock(lock, LOCK_UN);
+        close(lock);
+    #endif
+}
+
+//Emits every frame in full, one after another.
+void Converter::emitFrames(int64_t frames) {
+    int wordCount = frameWordCount();
+    int64_t window = frameWindow();
+    vector<WORD> words;
+    if (memoryImage == NULL && outputStream == NULL) {
+        //Each frame has a fixed place in the file, where updateFile() can rewrite it:
+        frameDataOffset = assemblingOutput() ? (int64_t)wordAddress * 2 : outputWritten + outputUsed;
+    }
+    for (int64_t x=0; x<frames; x+=window) {
+        int64_t count = loadFrames(x, min(window, frames - x));
+        if (count == 0) {
+            break; //The stream has ended
+        }
+        words.resize(count * wordCount);
+        convertFrames(x, count, &words[0]);
+        for (size_t i=0; i<words.size(); ++i) {
+            emitWord(words[i]);
+        }
+    }
+}
+
+//Plays a delta encoded animation by patching the frame at "screenLabel" in place. Each frame's delta is a
+//list of runs (length, offset, words...) ending with a zero length; a length of 0xFFFF starts over.
+void Converter::emitDeltaPlayer(const char *screenLabel) {
+    emitText("SET I, delta_space\n"
+             ":frame_loop\n"
+             "JSR delay\n"
+             ":next_run\n"
+             "SET C, [I]\n"
+             "ADD I, 1\n"
+             "IFE C, 0\n"
+             "SET PC, frame_loop\n"
+             "IFE C, 0xFFFF\n"
+             "SET PC, restart\n"
+             "SET J, [I]\n"
+             "ADD J, ");
+    emitText(screenLabel);
+    emitText("\n"
+             "ADD I, 1\n"
+             ":copy_word\n"
+             "STI [J], [I]\n"
+             "SUB C, 1\n"
+             "IFN C, 0\n"
+             "SET PC, copy_word\n"
+             "SET PC, next_run\n"
+             ":restart\n"
+             "SET I, delta_space\n"
+             "SET PC, next_run\n\n");
+    emitDelay();
+}
+
+//Emits the first frame as the keyframe, followed by the delta_space runs that turn each frame into the
+//next, and finally back into the first. Frames are converted a window at a time.
+void Converter::emitDeltaFrames(int64_t frames) {
+    int wordCount = frameWordCount();
+    int64_t window = frameWindow();
+    vector<WORD> first(wordCount), previous(wordCount), current(wordCount), converted;
+    loadFrames(0, 1);
+    convertFrames(0, 1, &first[0]);
+    for (int i=0; i<wordCount; ++i) {
+        emitWord(first[i]);
+    }
+    emitText("\n:delta_space DAT ");
+
+    previous = first;
+    int64_t windowStart = 1, windowEnd = 1; //Frames in "converted"
+    for (int64_t x=1; x<=frames; ++x) {
+        if (x == windowEnd && x < frames) {
+            int64_t count = loadFrames(x, min(window, frames - x));
+            if (count == 0) {
+                frames = x; //The stream has ended
+            }
+            converted.resize(count * wordCount);
+            if (count > 0) {
+                convertFrames(x, count, &converted[0]);
+            }
+            windowStart = x;
+            windowEnd = x + count;
+        }
+        if (x < frames) {
+            int64_t offset = x - windowStart; //Frame within the current window
+            copy(converted.begin() + offset * wordCount, converted.begin() + (offset + 1) * wordCount,
+                 current.begin());
+        }
+        else {
+            current = first;
+        }
+
+        //Changed words separated by two unchanged ones or fewer share a run, as a new run costs two words:
+        int i = 0;
+        while (i < wordCount) {
+            if (current[i] == previous[i]) {
+                ++i;
+                continue;
+            }
+            int end = i + 1, unchanged = 0;
+            for (int j=i+1; j<wordCount && unchanged <= 2; ++j) {
+                if (current[j] == previous[j]) {
+                    ++unchanged;
+                }
+                else {
+                    unchanged = 0;
+                    end = j + 1;
+                }
+            }
+            emitWord(end - i);
+            emitWord(i);
+            for (int j=i; j<end; ++j) {
+                emitWord(current[j]);
+            }
+            i = end;
+        }
+        emitWord(0);
+        swap(previous, current);
+    }
+    emitWord(0xFFFF);
+}
+
+//Plays the frames at "screenLabel" in the order given by frame_table, a list of word offsets ending with 0xFFFF.
+void Converter::emitIndexedPlayer(const char *screenLabel) {
+    emitText("SET I, frame_table\n"
+             ":frame_loop\n"
+             "IFE [I], 0xFFFF\n"
+             "SET I, frame_table\n"
+             "SET B, [I]\n"
+             "ADD B, ");
+    emitText(screenLabel);
+    emitText("\n"
+             "HWI [monitor]\n"
+             "JSR delay\n"
+             "ADD I, 1\n"
+             "SET PC, frame_loop\n\n");
+    emitDelay();
+}
+
+//Emits each distinct frame once, then frame_table. A frame whose pixels repeat an earlier one isn't
+//converted again, and frames that differ in pixels but convert to the same words are stored once too.
+//Each window of frames is hashed and converted on the worker threads, and then matched in order.
+void Converter::emitUniqueFrames(int64_t frames) {
+    int wordCount = frameWordCount();
+    int64_t window = frameWindow();
+    multimap<uint64_t, int64_t> pixelHashes; //Hash of a frame's pixels -> the first frame with them
+    multimap<uint64_t, int64_t> wordHashes;  //Hash of a unique frame's words -> its index
+    vector<WORD> uniqueWords;                //Words of every unique frame, kept to confirm hash matches
+    vector<int64_t> sourceUnique(frames);    //Unique frame shown for each frame
+    vector<uint64_t> hashes;
+    vector<int64_t> pixelSource;             //First frame with the same pixels as each frame of the window
+    vector<int64_t> converted;               //Frames of the window that need converting
+    vector<WORD> words;
+
+    uniqueFrames = 0;
+    for (int64_t first=0; first<frames; first+=window) {
+        int64_t count = min(window, frames - first);
+        hashes.resize(count);
+        runWorkers(count, [&](size_t frame) {
+            hashes[frame] = hashFramePixels(first + frame);
+        });
+
+        pixelSource.assign(count, -1);
+        converted.clear();
+        for (int64_t x=first; x<first + count; ++x) {
+            pair<multimap<uint64_t, int64_t>::iterator, multimap<uint64_t, int64_t>::iterator> matches;
+            matches = pixelHashes.equal_range(hashes[x - first]);
+            for (multimap<uint64_t, int64_t>::iterator match = matches.first; match != matches.second; ++match) {
+                if (framePixelsEqual(match->second, x)) {
+                    pixelSource[x - first] = match->second;
+                    break;
+                }
+            }
+            if (pixelSource[x - first] < 0) {
+                pixelHashes.insert(make_pair(hashes[x - first], x));
+                converted.push_back(x);
+            }
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        words.resize(converted.size() * wordCount);
+        runWorkers(converted.size(), [&](size_t frame) {
+            convertCachedFrame(converted[frame], &words[frame * wordCount]);
+        });
+        releasePixels((first + count) * frameWidth());
+        tileSeconds += secondsSince(start);
+
+        vector<WORD>::iterator frameWords = words.begin();
+        for (int64_t x=first; x<first + count; ++x) {
+            if (pixelSource[x - first] >= 0) {
+                sourceUnique[x] = sourceUnique[pixelSource[x - first]];
+                continue;
+            }
+            int64_t unique = -1;
+            uint64_t wordHash = hashBytes(&*frameWords, wordCount * sizeof(WORD), 14695981039346656037ULL);
+            pair<multimap<uint64_t, int64_t>::iterator, multimap<uint64_t, int64_t>::iterator> matches;
+            matches = wordHashes.equal_range(wordHash);
+            for (multimap<uint64_t, int64_t>::iterator match = matches.first; match != matches.second; ++match) {
+                if (equal(frameWords, frameWords + wordCount, uniqueWords.begin() + match->second * wordCount)) {
+                    unique = match->second;
+                    break;
+                }
+            }
+            if (unique < 0) {
+                unique = uniqueFrames++;
+                wordHashes.insert(make_pair(wordHash, unique));
+                uniqueWords.insert(uniqueWords.end(), frameWords, frameWords + wordCount);
+                for (int i=0; i<wordCount; ++i) {
+                    emitWord(frameWords[i]);
+                }
+            }
+            sourceUnique[x] = unique;
+            frameWords += wordCount;
+        }
+    }
+
+    emitText("\n:frame_table DAT ");
+    for (int64_t x=0; x<frames; ++x) {
+        emitWord(sourceUnique[x] * wordCount);
+    }
+    emitWord(0xFFFF);
+}
+
+//Plays a glyph dictionary animation. Each record in frame_space is the offset of its font from font_space,
+//followed by the 16x8 screen cells of the centered image, which are copied into tile_space. The font is only
+//uploaded again when it differs from the last one (kept in Y). An offset of 0xFFFF starts over.
+void Converter::emitGlyphPlayer() {
+    stringstream player;
+    player << "SET I, frame_space\n"
+              ":frame_loop\n"
+              "IFE [I], 0xFFFF\n"
+              "SET I, frame_space\n"
+              "SET B, [I]\n"
+              "ADD B, font_space\n"
+              "IFE B, Y\n"
+              "SET PC, copy_cells\n"
+              "SET Y, B\n"
+              "SET A, 1\n"
+              "HWI [monitor]\n"
+              ":copy_cells\n"
+              "ADD I, 1\n"
+              "SET J, tile_space\n"
+              "ADD J, " << centerOffset << "\n"
+              "SET C, 8\n"
+              ":copy_row\n"
+              "SET X, 16\n"
+              ":copy_cell\n"
+              "STI [J], [I]\n"
+              "SUB X, 1\n"
+              "IFN X, 0\n"
+              "SET PC, copy_cell\n"
+              "ADD J, 16\n"
+              "SUB C, 1\n"
+              "IFN C, 0\n"
+              "SET PC, copy_row\n"
+              "JSR delay\n"
+              "SET PC, frame_loop\n\n";
+    emitText(player.str().c_str());
+    emitDelay();
+}
+
+//Emits the glyph dictionary as a run of 128-glyph fonts, followed by frame_space. Frames share the current
+//font until one needs more glyphs than it has room for, and then a new font is started.
+void Converter::emitGlyphFrames(int64_t frames) {
+    int wordCount = frameWordCount();
+    int64_t window = frameWindow();
+    vector<WORD> converted;
+    vector<vector<uint32_t> > fonts(1);       //Glyphs of each font, as both words of the glyph
+    map<uint32_t, int> fontGlyphs;             //Glyphs in the newest font -> their character
+    vector<WORD> cells;                        //Font offset and cells of every frame
+
+    for (int64_t x=0; x<frames; ++x) {
+        if (x % window == 0) {
+            int64_t count = min(window, frames - x);
+            converted.resize(count * wordCount);
+            convertFrames(x, count, &converted[0]);
+        }
+        const WORD *words = &converted[x % window * wordCount];
+
+        //Count the glyphs that the newest font doesn't have yet:
+        vector<uint32_t> glyphs(128);
+        int missing = 0;
+        for (int i=0; i<128; ++i) {
+            glyphs[i] = (uint32_t)words[2*i] << 16 | words[2*i + 1];
+            if (fontGlyphs.find(glyphs[i]) == fontGlyphs.end() &&
+                find(glyphs.begin(), glyphs.begin() + i, glyphs[i]) == glyphs.begin() + i) {
+                ++missing;
+            }
+        }
+        if (fonts.back().size() + missing > 128) {
+            fonts.push_back(vector<uint32_t>());
+            fontGlyphs.clear();
+        }
+
+        cells.push_back((fonts.size() - 1) * 256);
+        for (int i=0; i<128; ++i) {
+            map<uint32_t, int>::iterator glyph = fontGlyphs.find(glyphs[i]);
+            if (glyph == fontGlyphs.end()) {
+                glyph = fontGlyphs.insert(make_pair(glyphs[i], (int)fonts.back().size())).first;
+                fonts.back().push_back(glyphs[i]);
+            }
+            cells.push_back(0x0100 + glyph->second); //Black on white, like the fixed tile_space
+        }
+    }
+
+    for (size_t font=0; font<fonts.size(); ++font) {
+        for (int i=0; i<128; ++i) {
+            uint32_t glyph = i < (int)fonts[font].size() ? fonts[font][i] : 0;
+            emitWord(glyph >> 16);
+            emitWord(glyph & 0xFFFF);
+        }
+    }
+    fontCount = fonts.size();
+
+    emitText("\n:frame_space DAT ");
+    for (size_t i=0; i<cells.size(); ++i) {
+        emitWord(cells[i]);
+    }
+    emitWord(0xFFFF);
+}
+
+//Plays packed frames by unpacking each one into a buffer after the program, starting at "screenLabel", and
+//mapping it to the monitor with HWI "mapCommand". Two buffers (Y and Z) alternate, so a frame is never shown
+//half unpacked. A still image is unpacked once, straight into the buffer that is already mapped.
+void Converter::emitCodecPlayer(const char *screenLabel, int mapCommand) {
+    stringstream player;
+    if (animationFlag == false) {
+        player << "SET I, packed_space\n"
+                  "SET J, " << screenLabel << "\n"
+                  "JSR unpack\n"
+                  "BRK\n";
+    }
+    else {
+        player << "SET I, packed_space\n"
+                  "SET Y, " << screenLabel << "\n"
+                  "SET Z, " << screenLabel << "\n"
+                  "ADD Z, " << frameWordCount() << "\n"
+                  ":frame_loop\n"
+                  "IFE [I], 0xFFFF\n"
+                  "SET I, packed_space\n"
+                  "SET J, Y\n"
+                  "JSR unpack\n"
+                  "SET A, " << mapCommand << "\n"
+                  "SET B, Y\n"
+                  "HWI [monitor]\n"
+                  "SET PUSH, Y\n"
+                  "SET Y, Z\n"
+                  "SET Z, POP\n"
+                  "JSR delay\n"
+                  "SET PC, frame_loop\n\n";
+    }
+    emitText(player.str().c_str());
+    emitUnpackRoutine();
+    if (animationFlag == true) {
+        emitDelay();
+    }
+}
+
+//Emits the routine that unpacks one frame from [I] to [J], leaving I at the next frame. Both codecs use a
+//token word: zero ends the frame, and a token below 0x8000 is followed by that many literal words. With the
+//high bit set, RLE repeats the next word and LZ copies from the given distance back in the frame.
+void Converter::emitUnpackRoutine() {
+    emitText(":unpack\n"
+             "SET C, [I]\n"
+             "ADD I, 1\n"
+             "IFE C, 0\n"
+             "SET PC, POP\n"
+             "IFB C, 0x8000\n"
+             "SET PC, unpack_repeat\n"
+             ":unpack_literal\n"
+             "STI [J], [I]\n"
+             "SUB C, 1\n"
+             "IFN C, 0\n"
+             "SET PC, unpack_literal\n"
+             "SET PC, unpack\n"
+             ":unpack_repeat\n"
+             "AND C, 0x7FFF\n");
+    if (options.packingCodec == RLE_CODEC) {
+        emitText("SET A, [I]\n"
+                 "ADD I, 1\n"
+                 ":unpack_fill\n"
+                 "SET [J], A\n"
+                 "ADD J, 1\n"
+                 "SUB C, 1\n"
+                 "IFN C, 0\n"
+                 "SET PC, unpack_fill\n"
+                 "SET PC, unpack\n");
+    }
+    else {
+        emitText("SET A, J\n"
+                 "SUB A, [I]\n"
+                 "ADD I, 1\n"
+                 ":unpack_copy\n"
+                 "SET [J], [A]\n"
+                 "ADD J, 1\n"
+                 "ADD A, 1\n"
+                 "SUB C, 1\n"
+                 "IFN C, 0\n"
+                 "SET PC, unpack_copy\n"
+                 "SET PC, unpack\n");
+    }
+}
+
+//Emits packed_space: every frame packed with the selected codec, then 0xFFFF. Frames are converted and packed
+//on the worker threads a window at a time.
+void Converter::emitPackedFrames(int64_t frames) {
+    int wordCount = frameWordCount();
+    int64_t window = frameWindow();
+    vector<WORD> words;
+    vector<vector<WORD> > packed;
+    for (int64_t x=0; x<frames; x+=window) {
+        int64_t count = loadFrames(x, min(window, frames - x));
+        if (count == 0) {
+            break; //The stream has ended
+        }
+        words.resize(count * wordCount);
+        convertFrames(x, count, &words[0]);
+        packed.resize(count);
+        runWorkers(count, [&](size_t frame) {
+            packed[frame].clear();
+            packFrame(&words[frame * wordCount], wordCount, options.packingCodec, packed[frame]);
+        });
+        for (int64_t frame=0; frame<count; ++frame) {
+            for (size_t i=0; i<packed[frame].size(); ++i) {
+                emitWord(packed[frame][i]);
+            }
+        }
+    }
+    emitWord(0xFFFF);
+}
+
+//Appends one frame packed with "codec" to "packed". Returns the estimated DCPU cycles to unpack it, counted
+//from the 1.7 cycle costs of the instructions each token and word runs through in the unpack routine.
+int64_t packFrame(const WORD *words, int count, int codec, vector<WORD> &packed) {
+    const int TOKEN_CYCLES = 11;    //Reading and testing a token, up to the literal or repeat branch
+    const int LITERAL_CYCLES = 8;   //Copying one literal word
+    const int REPEAT_CYCLES = 9;    //Extra cycles to set up a repeat
+    const int RLE_WORD_CYCLES = 9;  //Writing one repeated word
+    const int LZ_WORD_CYCLES = 11;  //Copying one word from earlier in the frame
+    const int CALL_CYCLES = 10;     //JSR unpack, the end token and the return
+    const int MAX_RUN = 0x7FFE;
+
+    int64_t cycles = CALL_CYCLES;
+    int literalStart = 0;
+    //Flushes the literals waiting before position "end":
+    auto flushLiterals = [&](int end) {
+        while (literalStart < end) {
+            int length = min(end - literalStart, MAX_RUN);
+            packed.push_back(length);
+            packed.insert(packed.end(), words + literalStart, words + literalStart + length);
+            cycles += TOKEN_CYCLES + length * LITERAL_CYCLES;
+            literalStart += length;
+        }
+    };
+
+    if (codec == RLE_CODEC) {
+        int i = 0;
+        while (i < count) {
+            int run = 1;
+            while (i + run < count && run < MAX_RUN && words[i + run] == words[i]) {
+                ++run;
+            }
+            //A repeat costs two words, so shorter runs are cheaper as literals:
+            if (run >= 3) {
+                flushLiterals(i);
+                packed.push_back(0x8000 | run);
+                packed.push_back(words[i]);
+                cycles += TOKEN_CYCLES + REPEAT_CYCLES + run * RLE_WORD_CYCLES;
+                literalStart = i + run;
+            }
+            i += run;
+        }
+        flushLiterals(count);
+    }
+    else if (codec == LZ_CODEC) {
+        //Greedy LZ77 over the frame, finding matches through chains of earlier positions with the same
+        //three words. Overlapping matches repeat a pattern, which covers runs as well.
+        const int HASH_SIZE = 1024;
+        const int MAX_CHAIN = 32;
+        vector<int> head(HASH_SIZE, -1), previous(count, -1);
+        auto hashAt = [&](int i) {
+            return (words[i] * 31u * 31u + words[i+1] * 31u + words[i+2]) % HASH_SIZE;
+        };
+        int i = 0;
+        while (i < count) {
+            int bestLength = 0, bestDistance = 0;
+            if (i + 2 < count) {
+                int chain = 0;
+                for (int candidate = head[hashAt(i)]; candidate >= 0 && chain < MAX_CHAIN;
+                     candidate = previous[candidate], ++chain) {
+                    int length = 0;
+                    while (i + length < count && length < MAX_RUN && words[candidate + length] == words[i + length]) {
+                        ++length;
+                    }
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = i - candidate;
+                    }
+                }
+            }
+            int step = bestLength >= 3 ? bestLength : 1;
+            if (bestLength >= 3) {
+                flushLiterals(i);
+                packed.push_back(0x8000 | bestLength);
+                packed.push_back(bestDistance);
+                cycles += TOKEN_CYCLES + REPEAT_CYCLES + bestLength * LZ_WORD_CYCLES;
+                literalStart = i + bestLength;
+            }
+            for (int j=i; j<i+step; ++j) {
+                if (j + 2 < count) {
+                    int hash = hashAt(j);
+                    previous[j] = head[hash];
+                    head[hash] = j;
+                }
+            }
+            i += step;
+        }
+        flushLiterals(count);
+    }
+    else {
+        flushLiterals(count);
+    }
+    packed.push_back(0);
+    return cycles;
+}
+
+//Packs every frame with each codec and reports the size and estimated unpacking cost of each. A full color
+//image's palette is chosen once, and kept in the options for the program to be saved with.
+void Converter::reportCodecs(int64_t frames, ostream &log) {
+    if (imageMode == LOW_RES_FULL && !options.sharedPaletteReady) {
+        generateColorPalette();
+        memcpy(options.sharedPalette, currentPalette, sizeof(currentPalette));
+        options.sharedPaletteReady = true;
+    }
+    int wordCount = frameWordCount();
+    int64_t window = frameWindow();
+    vector<WORD> words;
+    vector<int64_t> frameWords, frameCycles; //Packed size and cycles of each frame of the window, per codec
+    int64_t totalWords[3] = {0, 1, 1}, totalCycles[3] = {}; //Packed frames are followed by 0xFFFF
+    for (int64_t x=0; x<frames; x+=window) {
+        int64_t count = min(window, frames - x);
+        words.resize(count * wordCount);
+        convertFrames(x, count, &words[0]);
+        frameWords.assign(count * 3, 0);
+        frameCycles.assign(count * 3, 0);
+        runWorkers(count, [&](size_t frame) {
+            vector<WORD> packed;
+            for (int codec=RLE_CODEC; codec<=LZ_CODEC; ++codec) {
+                packed.clear();
+                frameCycles[frame * 3 + codec] = packFrame(&words[frame * wordCount], wordCount, codec, packed);
+                frameWords[frame * 3 + codec] = packed.size();
+            }
+        });
+        //Unpacked frames are used where they are, at no cost:
+        totalWords[NO_CODEC] += count * wordCount;
+        for (int64_t frame=0; frame<count; ++frame) {
+            for (int codec=RLE_CODEC; codec<=LZ_CODEC; ++codec) {
+                totalWords[codec] += frameWords[frame * 3 + codec];
+                totalCycles[codec] += frameCycles[frame * 3 + codec];
+            }
+        }
+    }
+    log << "\n       Codec    Words  Ratio  Unpack cycles/frame\n";
+    for (int codec=0; codec<3; ++codec) {
+        log << setw(12) << codecNames[codec] << setw(9) << totalWords[codec] << setw(7) << fixed
+            << setprecision(2) << (double)totalWords[codec] / (frames * wordCount) << setw(21)
+            << totalCycles[codec] / frames << "\n";
+    }
+}
+
+//Hash of a block of memory, continuing from "hash". Eight bytes are mixed in at a time, like FNV-1a with a
+//shift to carry the high bits down, and any bytes left over one at a time.
+uint64_t hashBytes(const void *data, size_t length, uint64_t hash) {
+    const BYTE *bytes = (const BYTE *)data;
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    for (size_t i=0; i<length; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//Hash of the pixels of frame "x".
+uint64_t Converter::hashFramePixels(int64_t x) {
+    int width = frameWidth();
+    uint64_t hash = 14695981039346656037ULL;
+    for (int64_t row=0; row<bih.biHeight; ++row) {
+        hash = hashBytes(&pixel(x * width, row), width * 3, hash);
+    }
+    return hash;
+}
+
+//Whether frames "x" and "y" have identical pixels.
+bool Converter::framePixelsEqual(int64_t x, int64_t y) {
+    int width = frameWidth();
+    for (int64_t row=0; row<bih.biHeight; ++row) {
+        if (memcmp(&pixel(x * width, row), &pixel(y * width, row), width * 3) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Opens the output file for the emit functions. Returns false if it can't be created.
+bool Converter::openOutput(const char *filename) {
+    outputUsed = 0;
+    outputWritten = 0;
+    frameDataOffset = -1;
+    outputFailed = false;
+    pendingLine.clear();
+    datLine = false;
+    wordAddress = 0;
+    labels.clear();
+    fixups.clear();
+    assemblerError.clear();
+    #ifdef __WIN32__
+        outputFile = CreateFile(filename,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+        return outputFile != INVALID_HANDLE_VALUE;
+    #else
+        outputFile = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        return outputFile >= 0;
+    #endif
+}
+
+//Writes everything in the output buffer to the output file, or to outputStream when it's set.
+void Converter::flushOutput() {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    const char *data = outputBuffer;
+    if (outputStream != NULL && outputUsed > 0 && !outputFailed) {
+        if (!outputStream->write(data, outputUsed)) {
+            outputFailed = true;
+        }
+        outputUsed = 0;
+    }
+    while (outputUsed > 0 && !outputFailed) {
+        #ifdef __WIN32__
+            DWORD written = 0;
+            if (!WriteFile(outputFile,data,outputUsed,&written,NULL)) {
+                outputFailed = true;
+            }
+        #else
+            ssize_t written = write(outputFile, data, outputUsed);
+            if (written < 0) {
+                outputFailed = true;
+                written = 0;
+            }
+        #endif
+        data += written;
+        outputUsed -= written;
+        outputWritten += written;
+    }
+    outputUsed = 0;
+    writeSeconds += secondsSince(start);
+}
+
+//Flushes and closes the output file, first resolving labels for binary output. Returns false if any write
+//failed or the program could not be assembled.
+bool Converter::closeOutput(const char *filename) {
+    flushOutput();
+    if (assemblingOutput()) {
+        if (!pendingLine.empty()) {
+            assembleLine(pendingLine);
+            pendingLine.clear();
+        }
+        if (!resolveLabels(filename)) {
+            outputFailed = true;
+        }
+    }
+    #ifdef __WIN32__
+        CloseHandle(outputFile);
+    #else
+        close(outputFile);
+    #endif
+    return !outputFailed;
+}
+
+//Copies a piece of assembly text into the output buffer, or assembles it for binary output.
+void Converter::emitText(const char *text) {
+    if (assemblingOutput()) {
+        for (; *text != '\0'; ++text) {
+            if (*text == '\n') {
+                assembleLine(pendingLine);
+                pendingLine.clear();
+                datLine = false;
+            }
+            else {
+                pendingLine += *text;
+            }
+        }
+        return;
+    }
+    size_t length = strlen(text);
+    while (length > 0) {
+        if (outputUsed == OUTPUT_BUFFER_SIZE) {
+            flushOutput();
+        }
+        size_t chunk = min(length, (size_t)(OUTPUT_BUFFER_SIZE - outputUsed));
+        memcpy(outputBuffer + outputUsed, text, chunk);
+        outputUsed += chunk;
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+//Writes a word into the output buffer as a DAT entry ("0x1234, "), or as raw data for binary output.
+void Converter::emitWord(WORD word) {
+    static const char hexDigits[] = "0123456789abcdef";
+    if (assemblingOutput()) {
+        //Anything pending is the start of the DAT line that this word belongs to:
+        if (!pendingLine.empty()) {
+            assembleLine(pendingLine);
+            pendingLine.clear();
+            datLine = true;
+        }
+        bufferBinaryWord(word);
+        return;
+    }
+    if (outputUsed > OUTPUT_BUFFER_SIZE - 8) {
+        flushOutput();
+    }
+    char *out = outputBuffer + outputUsed;
+    out[0] = '0';
+    out[1] = 'x';
+    out[2] = hexDigits[(word >> 12) & 0xF];
+    out[3] = hexDigits[(word >> 8) & 0xF];
+    out[4] = hexDigits[(word >> 4) & 0xF];
+    out[5] = hexDigits[word & 0xF];
+    out[6] = ',';
+    out[7] = ' ';
+    outputUsed += 8;
+    ++wordAddress;
+}
+
+//Adds one DCPU word to the output buffer in the byte order of the binary format.
+void Converter::bufferBinaryWord(WORD word) {
+    if (memoryImage != NULL) {
+        if (wordAddress < memoryImage->size()) {
+            (*memoryImage)[wordAddress] = word;
+        }
+        ++wordAddress;
+        return;
+    }
+    if (outputUsed > OUTPUT_BUFFER_SIZE - 2) {
+        flushOutput();
+    }
+    if (options.outputFormat == BINARY_BIG_ENDIAN) {
+        outputBuffer[outputUsed++] = word >> 8;
+        outputBuffer[outputUsed++] = word & 0xFF;
+    }
+    else {
+        outputBuffer[outputUsed++] = word & 0xFF;
+        outputBuffer[outputUsed++] = word >> 8;
+    }
+    ++wordAddress;
+}
+
+//Assembles one line of the generated program: labels, an instruction or the values of a DAT.
+void Converter::assembleLine(const string &line) {
+    static const char *basicOps[] = {"", "SET", "ADD", "SUB", "MUL", "MLI", "DIV", "DVI", "MOD", "MDI", "AND", "BOR",
+                                     "XOR", "SHR", "ASR", "SHL", "IFB", "IFC", "IFE", "IFN", "IFG", "IFA", "IFL", "IFU",
+                                     "", "", "ADX", "SBX", "", "", "STI", "STD"};
+    static const char *specialOps[] = {"", "JSR", "", "", "", "", "", "", "INT", "IAG", "IAS", "RFI", "IAQ", "", "",
+                                       "", "HWN", "HWQ", "HWI"};
+    stringstream tokens(line);
+    string token;
+    tokens >> token;
+    //Labels:
+    while (!token.empty() && token[0] == ':') {
+        labels[token.substr(1)] = wordAddress;
+        token.clear();
+        tokens >> token;
+    }
+    string mnemonic = token;
+    transform(mnemonic.begin(), mnemonic.end(), mnemonic.begin(), ::toupper);
+
+    //Whatever follows is a comma separated operand list:
+    string rest;
+    getline(tokens, rest);
+    vector<string> operands;
+    stringstream list(rest);
+    for (string operand; getline(list, operand, ',');) {
+        operand.erase(0, operand.find_first_not_of(" \t"));
+        operand.erase(operand.find_last_not_of(" \t") + 1);
+        if (!operand.empty()) {
+            operands.push_back(operand);
+        }
+    }
+
+    if (datLine) {
+        //A continued DAT line holds values only:
+        operands.clear();
+        stringstream values(line);
+        for (string value; getline(values, value, ',');) {
+            if (value.find_first_not_of(" \t") != string::npos) {
+                operands.push_back(value);
+            }
+        }
+        mnemonic = "DAT";
+    }
+    if (mnemonic.empty()) {
+        return;
+    }
+    if (mnemonic == "DAT") {
+        for (size_t i=0; i<operands.size(); ++i) {
+            bufferBinaryWord(strtol(operands[i].c_str(), NULL, 0));
+        }
+        return;
+    }
+    if (mnemonic == "BRK") {
+        //DCPU 1.7 has no BRK, so the program halts by jumping to itself instead (SUB PC, 1):
+        bufferBinaryWord(0x8b83);
+        return;
+    }
+
+    WORD aWord = 0, bWord = 0;
+    string aLabel, bLabel;
+    bool aNext = false, bNext = false;
+    int instruction = -1;
+    for (int op=0; op<32 && operands.size() == 2; ++op) {
+        if (mnemonic == basicOps[op]) {
+            int b = encodeOperand(operands[0], false, bWord, bLabel, bNext);
+            int a = encodeOperand(operands[1], true, aWord, aLabel, aNext);
+            if (a >= 0 && b >= 0) {
+                instruction = (a << 10) | (b << 5) | op;
+            }
+        }
+    }
+    for (int op=0; op<19 && operands.size() == 1; ++op) {
+        if (mnemonic == specialOps[op]) {
+            int a = encodeOperand(operands[0], true, aWord, aLabel, aNext);
+            if (a >= 0) {
+                instruction = (a << 10) | (op << 5);
+            }
+        }
+    }
+    if (instruction < 0) {
+        if (assemblerError.empty()) {
+            assemblerError = "Can't assemble '" + line + "'.";
+        }
+        return;
+    }
+
+    //The instruction is followed by the next word of a, then the next word of b:
+    bufferBinaryWord(instruction);
+    if (aNext) {
+        if (!aLabel.empty()) {
+            fixups.push_back(make_pair(wordAddress, aLabel));
+        }
+        bufferBinaryWord(aWord);
+    }
+    if (bNext) {
+        if (!bLabel.empty()) {
+            fixups.push_back(make_pair(wordAddress, bLabel));
+        }
+        bufferBinaryWord(bWord);
+    }
+}
+
+//Returns the 5 or 6-bit code of an operand, or -1 if it isn't valid. Literals and labels that don't fit in
+//the code are returned through "nextWord" or "nextLabel".
+int encodeOperand(const string &operand, bool isA, WORD &nextWord, string &nextLabel, bool &hasNextWord) {
+    static const string registers = "ABCXYZIJ";
+    string upper = operand;
+    transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+    if (upper.size() == 1 && registers.find(upper[0]) != string::npos) {
+        return registers.find(upper[0]);
+    }
+    if (upper == "POP" || upper == "PUSH") {
+        return 0x18;
+    }
+    if (upper == "PEEK") {
+        return 0x19;
+    }
+    if (upper == "SP") {
+        return 0x1b;
+    }
+    if (upper == "PC") {
+        return 0x1c;
+    }
+    if (upper == "EX") {
+        return 0x1d;
+    }
+
+    bool memory = upper.size() > 2 && upper[0] == '[' && upper[upper.size() - 1] == ']';
+    string value = memory ? operand.substr(1, operand.size() - 2) : operand;
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t") + 1);
+    if (memory && value.size() == 1 && registers.find(toupper(value[0])) != string::npos) {
+        return 0x08 + registers.find(toupper(value[0]));
+    }
+
+    //A number or a label:
+    char *end;
+    long number = strtol(value.c_str(), &end, 0);
+    if (value.empty()) {
+        return -1;
+    }
+    if (*end != '\0') {
+        if (!isalpha(value[0]) && value[0] != '_') {
+            return -1;
+        }
+        nextLabel = value;
+        number = 0;
+    }
+    else if (isA && !memory && (number == -1 || number == 0xFFFF || (number >= 0 && number <= 30))) {
+        return 0x21 + (number == 0xFFFF ? -1 : number);
+    }
+    nextWord = number;
+    hasNextWord = true;
+    return memory ? 0x1e : 0x1f;
+}
+
+//Patches every label reference into the binary output and writes the symbol map next to it.
+bool Converter::resolveLabels(const char *filename) {
+    for (size_t i=0; i<fixups.size(); ++i) {
+        map<string, uint32_t>::iterator label = labels.find(fixups[i].second);
+        if (label == labels.end()) {
+            if (assemblerError.empty()) {
+                assemblerError = "Undefined label '" + fixups[i].second + "'.";
+            }
+            return false;
+        }
+        if (memoryImage != NULL) {
+            if (fixups[i].first < memoryImage->size()) {
+                (*memoryImage)[fixups[i].first] = label->second;
+            }
+            continue;
+        }
+        BYTE bytes[2];
+        if (options.outputFormat == BINARY_BIG_ENDIAN) {
+            bytes[0] = label->second >> 8;
+            bytes[1] = label->second & 0xFF;
+        }
+        else {
+            bytes[0] = label->second & 0xFF;
+            bytes[1] = (label->second >> 8) & 0xFF;
+        }
+        #ifdef __WIN32__
+            LARGE_INTEGER position;
+            position.QuadPart = (int64_t)fixups[i].first * 2;
+            DWORD written = 0;
+            if (!SetFilePointerEx(outputFile,position,NULL,FILE_BEGIN) || !WriteFile(outputFile,bytes,2,&written,NULL)) {
+                return false;
+            }
+        #else
+            if (pwrite(outputFile, bytes, 2, (off_t)fixups[i].first * 2) != 2) {
+                return false;
+            }
+        #endif
+    }
+
+    if (wordAddress > 0x10000 && assemblerError.empty()) {
+        assemblerError = "The program is larger than the DCPU's 65536-word memory.";
+        return false;
+    }
+    if (memoryImage != NULL) {
+        return true;
+    }
+
+    //The symbol map lists every label in address order:
+    vector<pair<uint32_t, string> > symbols;
+    for (map<string, uint32_t>::iterator label = labels.begin(); label != labels.end(); ++label) {
+        symbols.push_back(make_pair(label->second, label->first));
+    }
+    sort(symbols.begin(), symbols.end());
+    FILE *symbolFile = fopen((string(filename) + ".sym").c_str(), "w");
+    if (symbolFile == NULL) {
+        return false;
+    }
+    for (size_t i=0; i<symbols.size(); ++i) {
+        fprintf(symbolFile, "0x%04x %s\n", symbols[i].first, symbols[i].second.c_str());
+    }
+    fprintf(symbolFile, "0x%04x end\n", wordAddress);
+    fclose(symbolFile);
+    return true;
+}
+
+//Assembles the program for the current image into "memory" without writing any files. Returns false with
+//assemblerError set if it can't be assembled.
+bool Converter::assembleProgram(vector<WORD> &memory) {
+    startAssembly(memory);
+    if (imageMode == HIGH_RES_SMALL) {
+        generateDCPUSmall();
+    }
+    else {
+        generateDCPUFull();
+    }
+    return finishAssembly();
+}
+
+//Assembles "text", written as the assembly output is, into "memory". Returns false with assemblerError set
+//if it can't be assembled.
+bool Converter::assembleText(const string &text, vector<WORD> &memory) {
+    startAssembly(memory);
+    emitText(text.c_str());
+    return finishAssembly();
+}
+
+//Points the emit functions at a fresh 65536-word "memory", for the assembler to fill.
+void Converter::startAssembly(vector<WORD> &memory) {
+    memory.assign(0x10000, 0);
+    memoryImage = &memory;
+    pendingLine.clear();
+    datLine = false;
+    wordAddress = 0;
+    labels.clear();
+    fixups.clear();
+    assemblerError.clear();
+}
+
+//Assembles the last line and resolves the labels of the program started by startAssembly(). Returns false
+//with assemblerError set if it can't be assembled.
+bool Converter::finishAssembly() {
+    if (!pendingLine.empty()) {
+        assembleLine(pendingLine);
+        pendingLine.clear();
+    }
+    bool resolved = resolveLabels(NULL);
+    memoryImage = NULL;
+    return resolved && assemblerError.empty();
+}
+
+//Number of words in the program with the current options, found by assembling it into memory. It's counted
+//in full even when it's larger than the DCPU's memory.
+int64_t Converter::measureProgram() {
+    vector<WORD> memory;
+    assembleProgram(memory);
+    return wordAddress;
+}
+
+//Fits the program into options.maxWords words, trying the layout as given and then each other layout from
+//the cheapest to play, with every frame and then keeping only 1 in 2, 1 in 3 and so on at a frame rate
+//lowered to match. A 64x48 animation that doesn't fit with every frame is letterboxed into 64x64 frames, which
+//take a third fewer words, before any are dropped. Each candidate is measured exactly by assembling it in
+//memory, along with the stack and the buffers that packed frames are unpacked into. The frames are only
+//converted once per frame step and the palette only chosen once, so a candidate costs little more than laying
+//out its words. The options are left as the first candidate that fits. Returns 0, or 2 after saying why in
+//"log" if none do.
+int Converter::planProgram(ostream &log) {
+    const int maxFrameStep = 60; //Keeps a stepped busy-wait in one word
+    const int stackWords = 4; //The deepest any player calls
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    ConverterOptions given = options;
+    int order[LAYOUT_COUNT] = {programLayout()};
+    for (int layout=0, i=1; layout<LAYOUT_COUNT; ++layout) {
+        if (layout != order[0]) {
+            order[i++] = layout;
+        }
+    }
+    cacheFrames = true;
+    int tried = 0;
+    int64_t smallest = INT64_MAX;
+    int64_t frames = frameCount();
+    bool switched = false;
+    for (int step=1; step<=maxFrameStep && (step == 1 || step < frames); ++step) {
+        setFrameStep(step, given);
+        if (imageMode != HIGH_RES_SMALL && !given.sharedPaletteReady) {
+            options.sharedPaletteReady = false;
+            generateColorPalette();
+            memcpy(options.sharedPalette, currentPalette, sizeof(currentPalette));
+            options.sharedPaletteReady = true;
+        }
+        for (int i=0; i<LAYOUT_COUNT; ++i) {
+            //Stills only differ when they're packed:
+            int layout = order[i];
+            if ((layout == GLYPH_LAYOUT && imageMode != HIGH_RES_SMALL) ||
+                (!animationFlag && layout != PLAIN_LAYOUT && layout != RLE_LAYOUT && layout != LZ_LAYOUT)) {
+                continue;
+            }
+            setProgramLayout(layout);
+            int64_t words = measureProgram() + stackWords;
+            if (options.packingCodec != NO_CODEC) {
+                words += frameWordCount() * (animationFlag ? 2 : 1);
+            }
+            ++tried;
+            smallest = min(smallest, words);
+            if (words <= options.maxWords) {
+                log << "        Plan : " << layoutNames[layout];
+                if (step > 1) {
+                    log << ", 1 in " << step << " frames";
+                    if (options.framesPerSecond > 0) {
+                        log << " at " << options.framesPerSecond << " fps";
+                    }
+                }
+                log << ", " << words << " of " << options.maxWords << " words (" << tried << " tried in "
+                    << (int64_t)(secondsSince(start) * 1000 + 0.5) << " ms).\n";
+                return 0;
+            }
+        }
+        if (!animationFlag) {
+            break;
+        }
+        if (step == 1 && imageMode == HIGH_RES_FULL && !switched) {
+            setFrameStep(1, given);
+            options.resampleMode = HIGH_RES_SMALL;
+            options.sharedPaletteReady = given.sharedPaletteReady;
+            if (!resampleImage(frames, log)) {
+                break;
+            }
+            imageMode = HIGH_RES_SMALL;
+            log << "   Mode Used : 64x64 Black and White, Centered, Animated.\n";
+            switched = true;
+            step = 0;
+        }
+    }
+    setFrameStep(1, given);
+    options = given;
+    log << "\nError: The program doesn't fit in " << options.maxWords << " words; the smallest of the " << tried
+        << " layouts tried takes " << smallest << ".\n";
+    return 2;
+}
+
+//Keeps only every "step"th frame of the animation, from the first, by reading the frames that much further
+//apart. The frame rate of "given" is lowered to match, and so is the busy-wait without one, so the animation
+//plays for as long; a frame that's kept is held for the holds given for it and the frames dropped after it.
+void Converter::setFrameStep(int step, const ConverterOptions &given) {
+    int width = frameWidth();
+    if (frameStep == 1) {
+        unsteppedFrames = bih.biWidth / width;
+        unsteppedStride = frameStride;
+    }
+    frameStep = step;
+    int64_t stride = unsteppedStride != 0 ? unsteppedStride : width * 3;
+    setFrameLayout(topRow, width, rowStride, step == 1 ? unsteppedStride : stride * step);
+    bih.biWidth = (unsteppedFrames + step - 1) / step * width;
+    quantizedFrames = 0; //The kept colors are of other frames now
+
+    options.framesPerSecond = given.framesPerSecond / step;
+    options.frameHoldMs.clear();
+    for (map<int64_t, int>::const_iterator hold = given.frameHoldMs.begin(); hold != given.frameHoldMs.end(); ++hold) {
+        int64_t kept = hold->first / step;
+        if (options.frameHoldMs.count(kept) || hold->first >= unsteppedFrames) {
+            continue;
+        }
+        double ms = 0;
+        for (int64_t x = kept * step; x < min((kept + 1) * step, unsteppedFrames); ++x) {
+            map<int64_t, int>::const_iterator frameHold = given.frameHoldMs.find(x);
+            ms += frameHold != given.frameHoldMs.end() ? frameHold->second : 1000 / given.framesPerSecond;
+        }
+        options.frameHoldMs[kept] = (int)(ms + 0.5);
+    }
+}
+
+//The layout the options give the frames, by the order the generators check them in.
+int Converter::programLayout() {
+    if (options.packingCodec != NO_CODEC) {
+        return options.packingCodec == RLE_CODEC ? RLE_LAYOUT : LZ_LAYOUT;
+    }
+    if (options.glyphDictionary && imageMode == HIGH_RES_SMALL) {
+        return GLYPH_LAYOUT;
+    }
+    if (options.deltaEncoding) {
+        return DELTA_LAYOUT;
+    }
+    return options.frameDedup ? DEDUP_LAYOUT : PLAIN_LAYOUT;
+}
+
+//Sets the options for "layout", and clears those of every other layout.
+void Converter::setProgramLayout(int layout) {
+    options.packingCodec = layout == RLE_LAYOUT ? RLE_CODEC : (layout == LZ_LAYOUT ? LZ_CODEC : NO_CODEC);
+    options.glyphDictionary = layout == GLYPH_LAYOUT;
+    options.deltaEncoding = layout == DELTA_LAYOUT;
+    options.frameDedup = layout == DEDUP_LAYOUT;
+}
+
+//Loads a program into a freshly reset DCPU.
+void resetDcpu(Dcpu &cpu, const vector<WORD> &program) {
+    cpu.memory = program;
+    memset(cpu.registers, 0, sizeof(cpu.registers));
+    cpu.pc = cpu.sp = cpu.ex = cpu.ia = 0;
+    cpu.queueing = false;
+    cpu.interrupts.clear();
+    cpu.cycles = cpu.hwiCount = 0;
+    cpu.literal = 0;
+    cpu.fault.clear();
+    cpu.screen = cpu.font = cpu.palette = cpu.border = 0;
+    cpu.clockInterval = cpu.clockMessage = 0;
+    cpu.clockStart = cpu.clockTicks = 0;
+}
+
+//Number of next words taken by an operand.
+inline int dcpuOperandWords(int code) {
+    return (code >= 0x10 && code <= 0x17) || code == 0x1a || code == 0x1e || code == 0x1f;
+}
+
+//Returns where operand "code" is read from and written to, reading its next word and adding its cycles.
+WORD *dcpuOperand(Dcpu &cpu, int code, bool isA, int &cycles) {
+    if (code < 0x08) {
+        return &cpu.registers[code];
+    }
+    if (code < 0x10) {
+        return &cpu.memory[cpu.registers[code - 0x08]];
+    }
+    if (code < 0x18) {
+        ++cycles;
+        return &cpu.memory[(WORD)(cpu.registers[code - 0x10] + cpu.memory[cpu.pc++])];
+    }
+    switch (code) {
+        case 0x18: //POP as a, PUSH as b
+            return isA ? &cpu.memory[cpu.sp++] : &cpu.memory[--cpu.sp];
+        case 0x19:
+            return &cpu.memory[cpu.sp];
+        case 0x1a:
+            ++cycles;
+            return &cpu.memory[(WORD)(cpu.sp + cpu.memory[cpu.pc++])];
+        case 0x1b:
+            return &cpu.sp;
+        case 0x1c:
+            return &cpu.pc;
+        case 0x1d:
+            return &cpu.ex;
+        case 0x1e:
+            ++cycles;
+            return &cpu.memory[cpu.memory[cpu.pc++]];
+        case 0x1f:
+            ++cycles;
+            cpu.literal = cpu.memory[cpu.pc++];
+            return &cpu.literal;
+    }
+    cpu.literal = code - 0x21; //Short literals, -1 to 30
+    return &cpu.literal;
+}
+
+//Adds an interrupt to the queue. More than 256 queued interrupts set the DCPU on fire.
+void dcpuInterrupt(Dcpu &cpu, WORD message) {
+    if (cpu.interrupts.size() >= 256) {
+        cpu.fault = "The interrupt queue overflowed.";
+        return;
+    }
+    cpu.interrupts.push_back(message);
+}
+
+//Sends a hardware interrupt to "device". Returns the cycles the device takes on top of HWI's own.
+int dcpuHardware(Dcpu &cpu, WORD device) {
+    WORD &a = cpu.registers[0];
+    WORD &b = cpu.registers[1];
+    ++cpu.hwiCount;
+    if (device == 0) {
+        switch (a) {
+            case 0: cpu.screen = b; break;
+            case 1: cpu.font = b; break;
+            case 2: cpu.palette = b; break;
+            case 3: cpu.border = b & 0xF; break;
+            case 4: return 256; //The built-in font isn't modelled; the generated programs always map their own
+            case 5:
+                for (int i=0; i<16; ++i) {
+                    cpu.memory[(WORD)(b + i)] = lemDefaultPalette[i];
+                }
+                return 16;
+        }
+    }
+    else if (device == 1) {
+        switch (a) {
+            case 0:
+                cpu.clockInterval = b;
+                cpu.clockStart = cpu.cycles;
+                cpu.clockTicks = 0;
+                break;
+            case 1: cpu.registers[2] = cpu.clockTicks; break;
+            case 2: cpu.clockMessage = b; break;
+        }
+    }
+    return 0;
+}
+
+//Runs one instruction, skipping the instructions after a failed test, then triggers the clock and at most
+//one queued interrupt. Returns the cycles taken.
+int stepDcpu(Dcpu &cpu) {
+    int cycles = 0;
+    WORD instruction = cpu.memory[cpu.pc++];
+    int op = instruction & 0x1f;
+    int b = (instruction >> 5) & 0x1f;
+    int a = instruction >> 10;
+    bool skip = false;
+
+    if (op == 0) {
+        WORD *pa = dcpuOperand(cpu, a, true, cycles);
+        WORD av = *pa;
+        switch (b) {
+            case 0x01: //JSR
+                cpu.memory[--cpu.sp] = cpu.pc;
+                cpu.pc = av;
+                cycles += 3;
+                break;
+            case 0x08: dcpuInterrupt(cpu, av); cycles += 4; break; //INT
+            case 0x09: *pa = cpu.ia; cycles += 1; break; //IAG
+            case 0x0a: cpu.ia = av; cycles += 1; break;  //IAS
+            case 0x0b: //RFI
+                cpu.queueing = false;
+                cpu.registers[0] = cpu.memory[cpu.sp++];
+                cpu.pc = cpu.memory[cpu.sp++];
+                cycles += 3;
+                break;
+            case 0x0c: cpu.queueing = av != 0; cycles += 2; break; //IAQ
+            case 0x10: *pa = 2; cycles += 2; break; //HWN
+            case 0x11: //HWQ
+                if (av == 0) {
+                    cpu.registers[0] = 0xf615;
+                    cpu.registers[1] = 0x7349;
+                    cpu.registers[2] = 0x1802;
+                    cpu.registers[3] = 0x8b36;
+                    cpu.registers[4] = 0x1c6c;
+                }
+                else {
+                    cpu.registers[0] = 0xb402;
+                    cpu.registers[1] = 0x12d0;
+                    cpu.registers[2] = 1;
+                    cpu.registers[3] = 0;
+                    cpu.registers[4] = 0;
+                }
+                cycles += 4;
+                break;
+            case 0x12: cycles += 4 + dcpuHardware(cpu, av); break; //HWI
+            default:
+                cpu.fault = "Illegal special instruction.";
+        }
+    }
+    else {
+        WORD *pa = dcpuOperand(cpu, a, true, cycles);
+        WORD av = *pa;
+        WORD *pb = dcpuOperand(cpu, b, false, cycles);
+        WORD bv = *pb;
+        int16_t sa = av, sb = bv;
+        uint32_t result;
+        switch (op) {
+            case 0x01: *pb = av; cycles += 1; break; //SET
+            case 0x02: result = bv + av; cpu.ex = result >> 16; *pb = result; cycles += 2; break; //ADD
+            case 0x03: cpu.ex = bv < av ? 0xFFFF : 0; *pb = bv - av; cycles += 2; break; //SUB
+            case 0x04: result = bv * av; cpu.ex = result >> 16; *pb = result; cycles += 2; break; //MUL
+            case 0x05: result = (int32_t)sb * sa; cpu.ex = result >> 16; *pb = result; cycles += 2; break; //MLI
+            case 0x06: //DIV
+                cpu.ex = av == 0 ? 0 : ((uint32_t)bv << 16) / av;
+                *pb = av == 0 ? 0 : bv / av;
+                cycles += 3;
+                break;
+            case 0x07: //DVI
+                cpu.ex = sa == 0 ? 0 : ((int32_t)sb << 16) / sa;
+                *pb = sa == 0 ? 0 : sb / sa;
+                cycles += 3;
+                break;
+            case 0x08: *pb = av == 0 ? 0 : bv % av; cycles += 3; break; //MOD
+            case 0x09: *pb = sa == 0 ? 0 : sb % sa; cycles += 3; break; //MDI
+            case 0x0a: *pb = bv & av; cycles += 1; break; //AND
+            case 0x0b: *pb = bv | av; cycles += 1; break; //BOR
+            case 0x0c: *pb = bv ^ av; cycles += 1; break; //XOR
+            case 0x0d: //SHR
+                cpu.ex = ((uint64_t)bv << 16) >> min((int)av, 63);
+                *pb = (uint64_t)bv >> min((int)av, 63);
+                cycles += 1;
+                break;
+            case 0x0e: //ASR
+                cpu.ex = ((int64_t)sb * 65536) >> min((int)av, 63);
+                *pb = (int64_t)sb >> min((int)av, 63);
+                cycles += 1;
+                break;
+            case 0x0f: //SHL
+                cpu.ex = ((uint64_t)bv << min((int)av, 63)) >> 16;
+                *pb = (uint64_t)bv << min((int)av, 63);
+                cycles += 1;
+                break;
+            case 0x10: skip = (bv & av) == 0; cycles += 2; break; //IFB
+            case 0x11: skip = (bv & av) != 0; cycles += 2; break; //IFC
+            case 0x12: skip = bv != av; cycles += 2; break; //IFE
+            case 0x13: skip = bv == av; cycles += 2; break; //IFN
+            case 0x14: skip = bv <= av; cycles += 2; break; //IFG
+            case 0x15: skip = sb <= sa; cycles += 2; break; //IFA
+            case 0x16: skip = bv >= av; cycles += 2; break; //IFL
+            case 0x17: skip = sb >= sa; cycles += 2; break; //IFU
+            case 0x1a: //ADX
+                result = bv + av + cpu.ex;
+                cpu.ex = result > 0xFFFF ? 1 : 0;
+                *pb = result;
+                cycles += 3;
+                break;
+            case 0x1b: { //SBX
+                int32_t difference = (int32_t)bv - av + cpu.ex;
+                cpu.ex = difference < 0 ? 0xFFFF : (difference > 0xFFFF ? 1 : 0);
+                *pb = difference;
+                cycles += 3;
+                break;
+            }
+            case 0x1e: *pb = av; ++cpu.registers[6]; ++cpu.registers[7]; cycles += 2; break; //STI
+            case 0x1f: *pb = av; --cpu.registers[6]; --cpu.registers[7]; cycles += 2; break; //STD
+            default:
+                cpu.fault = "Illegal instruction.";
+        }
+    }
+
+    //A failed test skips the next instruction, and any tests chained before it, at a cycle each:
+    while (skip) {
+        WORD next = cpu.memory[cpu.pc];
+        int nextOp = next & 0x1f;
+        cpu.pc += 1 + dcpuOperandWords(next >> 10) + (nextOp != 0 ? dcpuOperandWords((next >> 5) & 0x1f) : 0);
+        skip = nextOp >= 0x10 && nextOp <= 0x17;
+        ++cycles;
+    }
+    cpu.cycles += cycles;
+
+    while (cpu.clockInterval != 0 &&
+           (cpu.cycles - cpu.clockStart) * 60 >= (cpu.clockTicks + 1) * DCPU_HZ * cpu.clockInterval) {
+        ++cpu.clockTicks;
+        if (cpu.clockMessage != 0) {
+            dcpuInterrupt(cpu, cpu.clockMessage);
+        }
+    }
+
+    if (!cpu.queueing && !cpu.interrupts.empty()) {
+        WORD message = cpu.interrupts.front();
+        cpu.interrupts.erase(cpu.interrupts.begin());
+        if (cpu.ia != 0) {
+            cpu.queueing = true;
+            cpu.memory[--cpu.sp] = cpu.pc;
+            cpu.memory[--cpu.sp] = cpu.registers[0];
+            cpu.pc = cpu.ia;
+            cpu.registers[0] = message;
+        }
+    }
+    return cycles;
+}
+
+//Draws what the LEM1802 shows into "pixels" as 12-bit colors. Blinking cells are drawn in their visible
+//phase, and the border isn't drawn.
+void renderScreen(const Dcpu &cpu, WORD *pixels) {
+    if (cpu.screen == 0) {
+        fill(pixels, pixels + SCREEN_W * SCREEN_H, 0);
+        return;
+    }
+    for (int y=0; y<SCREEN_H; ++y) {
+        for (int x=0; x<SCREEN_W; ++x) {
+            WORD cell = cpu.memory[(WORD)(cpu.screen + (y / 8) * 32 + x / 4)];
+            WORD column = cpu.font == 0 ? 0 : cpu.memory[(WORD)(cpu.font + (cell & 0x7F) * 2 + (x & 3) / 2)];
+            BYTE bits = (x & 1) == 0 ? column >> 8 : column & 0xFF;
+            int color = (bits >> (y & 7)) & 1 ? cell >> 12 : (cell >> 8) & 0xF;
+            *pixels++ = cpu.palette == 0 ? lemDefaultPalette[color] : cpu.memory[(WORD)(cpu.palette + color)] & 0xFFF;
+        }
+    }
+}
+
+//Draws how frame "x" of the bitmap should look on the screen: full color images as blocks of their
+//palette colors, black and white ones as black where the pixel rounds to black and white elsewhere.
+void Converter::expectedScreen(int64_t x, WORD *pixels) {
+    for (int y=0; y<SCREEN_H; ++y) {
+        for (int i=0; i<SCREEN_W; ++i) {
+            WORD color = 0;
+            if (imageMode == LOW_RES_FULL) {
+                int index = roundColorToPalette(pixel(x * LOW_RES_FULL_W + i / 4, y / 4));
+                color = currentPalette[index][0] * 256 + currentPalette[index][1] * 16 + currentPalette[index][2];
+            }
+            else if (imageMode == HIGH_RES_FULL) {
+                color = roundColorValue(pixel(x * HIGH_RES_FULL_W + i / 2, y / 2)) == 0 ? 0x000 : 0xFFF;
+            }
+            else if (i >= 32 && i < 32 + HIGH_RES_SMALL_W && y >= 16 && y < 16 + HIGH_RES_SMALL_H) {
+                color = roundColorValue(pixel(x * HIGH_RES_SMALL_W + i - 32, y - 16)) == 0 ? 0x000 : 0xFFF;
+            }
+            *pixels++ = color;
+        }
+    }
+}
+
+//Runs the program for the current image on the built-in DCPU and compares every frame it shows with the
+//image. A frame is shown when the player calls delay, or for still images when the program halts. Returns
+//0 if every frame matches, or 5.
+int Converter::verifyProgram(ostream &log) {
+    const uint64_t MAX_FRAME_CYCLES = (uint64_t)1 << 27; //Over 20 minutes of DCPU time
+    log << "\nVerifying on the DCPU...";
+    if (stream != NULL) {
+        log << "\nError: A stream's frames aren't kept, so it can't be verified.\n";
+        return 5;
+    }
+
+    vector<WORD> program;
+    if (!assembleProgram(program)) {
+        log << "\nError: " << assemblerError << "\n";
+        return 5;
+    }
+    uint32_t programWords = wordAddress;
+    WORD delayAddress = labels.count("delay") ? labels["delay"] : 0;
+    int64_t frames = animationFlag ? bih.biWidth / frameWidth() : 1;
+
+    Dcpu cpu;
+    resetDcpu(cpu, program);
+    vector<WORD> shown(SCREEN_W * SCREEN_H), expected(SCREEN_W * SCREEN_H);
+    int64_t matching = 0;
+    string mismatches;
+    uint64_t frameStart = 0, waitCycles = 0;
+    uint64_t workTotal = 0, workMin = UINT64_MAX, workMax = 0;
+    int stackWords = 0;
+    bool waiting = false;
+    WORD returnAddress = 0;
+
+    for (int64_t x=0; x<frames;) {
+        WORD instruction = cpu.memory[cpu.pc];
+        if (waiting && cpu.pc == returnAddress) {
+            waiting = false;
+        }
+
+        //A JSR to delay, or for still images SUB PC, 1:
+        bool frameShown = animationFlag ? !waiting && instruction == 0x7c20 && cpu.memory[(WORD)(cpu.pc + 1)] == delayAddress
+                                        : instruction == 0x8b83;
+        if (frameShown) {
+            renderScreen(cpu, &shown[0]);
+            expectedScreen(x, &expected[0]);
+            int64_t wrong = 0;
+            for (size_t i=0; i<shown.size(); ++i) {
+                wrong += shown[i] != expected[i];
+            }
+            if (wrong == 0) {
+                ++matching;
+            }
+            else if (mismatches.size() < 400) {
+                stringstream mismatch;
+                mismatch << "\nError: Frame " << x << " differs from the image in " << wrong << " pixels.";
+                mismatches += mismatch.str();
+            }
+
+            uint64_t work = cpu.cycles - frameStart - waitCycles;
+            workTotal += work;
+            workMin = min(workMin, work);
+            workMax = max(workMax, work);
+            frameStart = cpu.cycles;
+            waitCycles = 0;
+            waiting = animationFlag;
+            returnAddress = cpu.pc + 2;
+            ++x;
+            if (x == frames) {
+                break;
+            }
+        }
+
+        int cycles = stepDcpu(cpu);
+        if (waiting) {
+            waitCycles += cycles;
+        }
+        if (cpu.sp != 0) {
+            stackWords = max(stackWords, 0x10000 - cpu.sp);
+        }
+        if (!cpu.fault.empty()) {
+            log << "\nError: " << cpu.fault << "\n";
+            return 5;
+        }
+        if (cpu.cycles - frameStart > MAX_FRAME_CYCLES) {
+            log << "\nError: Frame " << x << " wasn't shown within " << MAX_FRAME_CYCLES << " cycles.\n";
+            return 5;
+        }
+    }
+
+    //Work space is everything the program changed past its end, outside the stack:
+    uint32_t used = programWords;
+    for (uint32_t i=programWords; i<(uint32_t)(0x10000 - stackWords); ++i) {
+        if (cpu.memory[i] != program[i]) {
+            used = i + 1;
+        }
+    }
+
+    log << " Done.\n";
+    log << "      Frames : " << matching << " of " << frames << " match the image\n";
+    log << " Work Cycles : " << workTotal / frames << " per frame (min " << workMin << ", max " << workMax << ")\n";
+    log << "Total Cycles : " << cpu.cycles / frames << " per frame, including waits\n";
+    stringstream hwis;
+    hwis << fixed << setprecision(2) << (double)cpu.hwiCount / frames;
+    log << "  HWIs/Frame : " << hwis.str() << "\n";
+    log << "      Memory : " << used + stackWords << " words (program " << programWords << ", work space "
+        << used - programWords << ", stack " << stackWords << ")\n";
+    if (matching < frames) {
+        log << mismatches << "\n";
+        return 5;
+    }
+    return 0;
+}
+
+//Rounds off colors to the nearest possible value for the current DCPU palette
+int Converter::roundColorToPalette(RGBTRIPLE color) {
+    if (options.fullPrecision) {
+        return nearestPaletteColor(color.rgbtRed, color.rgbtGreen, color.rgbtBlue);
+    }
+    return paletteLookup[roundColorValue(color)];
+}
+
+//Finds the palette color closest to a 24-bit color under the current metric.
+int Converter::nearestPaletteColor(int red, int green, int blue) {
+    #ifdef __SSE2__
+        //Manhattan distances to all 16 palette colors, 8 at a time:
+        if (options.colorMetric == MANHATTAN_METRIC) {
+            __m128i r = _mm_set1_epi16(red), g = _mm_set1_epi16(green), b = _mm_set1_epi16(blue);
+            __m128i distance[2];
+            for (int half=0; half<2; ++half) {
+                const int *p = currentPalette[half * 8];
+                __m128i pr = _mm_setr_epi16(p[0]<<4, p[3]<<4, p[6]<<4, p[9]<<4, p[12]<<4, p[15]<<4, p[18]<<4, p[21]<<4);
+                __m128i pg = _mm_setr_epi16(p[1]<<4, p[4]<<4, p[7]<<4, p[10]<<4, p[13]<<4, p[16]<<4, p[19]<<4, p[22]<<4);
+                __m128i pb = _mm_setr_epi16(p[2]<<4, p[5]<<4, p[8]<<4, p[11]<<4, p[14]<<4, p[17]<<4, p[20]<<4, p[23]<<4);
+                __m128i dr = _mm_max_epi16(_mm_sub_epi16(r, pr), _mm_sub_epi16(pr, r));
+                __m128i dg = _mm_max_epi16(_mm_sub_epi16(g, pg), _mm_sub_epi16(pg, g));
+                __m128i db = _mm_max_epi16(_mm_sub_epi16(b, pb), _mm_sub_epi16(pb, b));
+                distance[half] = _mm_add_epi16(_mm_add_epi16(dr, dg), db);
+            }
+            //Smallest distance in every lane, then the first palette index that has it:
+            __m128i minimum = _mm_min_epi16(distance[0], distance[1]);
+            minimum = _mm_min_epi16(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+            minimum = _mm_min_epi16(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(2, 3, 0, 1)));
+            minimum = _mm_min_epi16(minimum, _mm_shufflelo_epi16(_mm_shufflehi_epi16(minimum, _MM_SHUFFLE(2, 3, 0, 1)),
+                                                                  _MM_SHUFFLE(2, 3, 0, 1)));
+            unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(distance[0], minimum)) |
+                                (_mm_movemask_epi8(_mm_cmpeq_epi16(distance[1], minimum)) << 16);
+            return __builtin_ctz(mask) / 2;
+        }
+    #endif
+
+    float minRGBdiff = 1e30f; //Set a high enough minimum to guarantee it will be overwritten
+    int closestColor = 0; //Closest palette color to the actual color
+    for (int i=0; i<16; ++i) {
+        float RGBdiff = colorDistance(red, green, blue, i);
+        //Select the color with the smallest deviation:
+        if (RGBdiff < minRGBdiff) {
+            minRGBdiff = RGBdiff;
+            closestColor = i;
+        }
+    }
+
+    return closestColor;
+}
+
+//Distance between a 24-bit color and a palette color under the current metric.
+float Converter::colorDistance(int red, int green, int blue, int paletteIndex) {
+    int dr = red - (currentPalette[paletteIndex][0] << 4);
+    int dg = green - (currentPalette[paletteIndex][1] << 4);
+    int db = blue - (currentPalette[paletteIndex][2] << 4);
+    if (options.colorMetric == EUCLIDEAN_METRIC) {
+        return dr*dr + dg*dg + db*db;
+    }
+    else if (options.colorMetric == PERCEPTUAL_METRIC) {
+        //CIE76: Euclidean distance in L*a*b* space
+        float lab[3];
+        rgbToLab(red, green, blue, lab);
+        float dl = lab[0] - paletteLab[paletteIndex][0];
+        float da = lab[1] - paletteLab[paletteIndex][1];
+        float dbb = lab[2] - paletteLab[paletteIndex][2];
+        return dl*dl + da*da + dbb*dbb;
+    }
+    return abs(dr) + abs(dg) + abs(db);
+}
+
+//Converts an sRGB color to CIE L*a*b* (D65 white point).
+void rgbToLab(int red, int green, int blue, float lab[3]) {
+    float linear[3];
+    int channels[3] = {red, green, blue};
+    for (int i=0; i<3; ++i) {
+        float c = channels[i] / 255.0f;
+        linear[i] = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+    float xyz[3];
+    xyz[0] = (0.4124f * linear[0] + 0.3576f * linear[1] + 0.1805f * linear[2]) / 0.95047f;
+    xyz[1] = (0.2126f * linear[0] + 0.7152f * linear[1] + 0.0722f * linear[2]);
+    xyz[2] = (0.0193f * linear[0] + 0.1192f * linear[1] + 0.9505f * linear[2]) / 1.08883f;
+    for (int i=0; i<3; ++i) {
+        xyz[i] = xyz[i] > 0.008856f ? cbrt(xyz[i]) : 7.787f * xyz[i] + 16.0f / 116.0f;
+    }
+    lab[0] = 116.0f * xyz[1] - 16.0f;
+    lab[1] = 500.0f * (xyz[0] - xyz[1]);
+    lab[2] = 200.0f * (xyz[1] - xyz[2]);
+}
+
+//Fills the 12-bit color lookup table for the current palette, so matching a pixel takes one table load.
+void Converter::buildPaletteLookup() {
+    for (int i=0; i<16; ++i) {
+        rgbToLab(currentPalette[i][0] << 4, currentPalette[i][1] << 4, currentPalette[i][2] << 4, paletteLab[i]);
+    }
+    for (int color=0; color<4096; ++color) {
+        paletteLookup[color] = nearestPaletteColor((color >> 8) << 4, ((color >> 4) & 0xF) << 4, (color & 0xF) << 4);
+    }
+}
+
+int roundColorValue(RGBTRIPLE color) {
+
+    //Convert 8-bit color values to 4-bit:
+    int closestR = (color.rgbtRed + 8) / 16;
+    if (closestR == 16)
+        closestR = 15;
+    int closestG = (color.rgbtGreen + 8) / 16;
+    if (closestG == 16)
+        closestG = 15;
+    int closestB = (color.rgbtBlue + 8) / 16;
+    if (closestB == 16)
+        closestB = 15;
+
+    //Concatenate RGB values:
+    return closestR * 256 + closestG * 16 + closestB;
+}
+
+//Rounds "count" BGR pixels from "bytes" to their 12-bit colors, as roundColorValue() does, into "colors".
+void quantizeColors(const BYTE *bytes, int64_t count, WORD *colors) {
+    int64_t i = 0;
+    #ifdef __SSE2__
+        //Split 32 pixels (96 bytes) at a time into their blue, green and red bytes, by interleaving the 6
+        //vectors with each other 5 times over. Each byte then rounds to 4 bits as min(byte + 8, 255) / 16.
+        const __m128i eight = _mm_set1_epi8(8);
+        const __m128i lowBits = _mm_set1_epi8(0x0F);
+        for (; i + 32 <= count; i += 32) {
+            __m128i v[6];
+            for (int j=0; j<6; ++j) {
+                v[j] = _mm_loadu_si128((const __m128i *)(bytes + i * 3 + j * 16));
+            }
+            for (int round=0; round<5; ++round) {
+                __m128i mixed[6] = {_mm_unpacklo_epi8(v[0], v[3]), _mm_unpackhi_epi8(v[0], v[3]),
+                                    _mm_unpacklo_epi8(v[1], v[4]), _mm_unpackhi_epi8(v[1], v[4]),
+                                    _mm_unpacklo_epi8(v[2], v[5]), _mm_unpackhi_epi8(v[2], v[5])};
+                copy(mixed, mixed + 6, v);
+            }
+            for (int j=0; j<6; ++j) {
+                v[j] = _mm_and_si128(_mm_srli_epi16(_mm_adds_epu8(v[j], eight), 4), lowBits);
+            }
+            //Blue and green share a byte, and red goes above it:
+            for (int half=0; half<2; ++half) {
+                __m128i blueGreen = _mm_or_si128(v[half], _mm_slli_epi16(v[2 + half], 4));
+                _mm_storeu_si128((__m128i *)(colors + i + half * 16), _mm_unpacklo_epi8(blueGreen, v[4 + half]));
+                _mm_storeu_si128((__m128i *)(colors + i + half * 16 + 8), _mm_unpackhi_epi8(blueGreen, v[4 + half]));
+            }
+        }
+    #endif
+    for (; i<count; ++i) {
+        colors[i] = roundColorValue(((const RGBTRIPLE *)bytes)[i]);
+    }
+}
+
+//Creates a color palette that closely matches the image.
+void Converter::generateColorPalette() {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (options.sharedPaletteReady) {
+        memcpy(currentPalette, options.sharedPalette, sizeof(currentPalette));
+    }
+    else {
+        uint64_t colorCounts[4096] = {};
+        if (stream != NULL) {
+            countStreamColors(colorCounts);
+        }
+        else {
+            countColors(colorCounts);
+        }
+        choosePalette(colorCounts, currentPalette);
+    }
+    buildPaletteLookup();
+    paletteSeconds += secondsSince(start);
+}
+
+//Counts how often each 12-bit color appears in the image, or in the loaded frames of a stream. The frames are
+//quantized a window at a time, split between the workers, which each count the colors of their own run of
+//frames. Full color frames keep their colors, up to QUANTIZED_COLORS_LIMIT, and the pixels of each window are
+//let go of once it's done, so this takes the same memory for any number of frames.
+void Converter::countColors(uint64_t colorCounts[4096]) {
+    const int64_t pixelsPerThread = 1 << 22;
+    int width = frameWidth();
+    int64_t frameColors = (int64_t)width * bih.biHeight;
+    int64_t first = firstColumn / width, end = bih.biWidth / width;
+    int64_t threadCount = min((int64_t)workerCount(), (end - first) * frameColors / pixelsPerThread + 1);
+    vector<uint64_t> bandCounts(threadCount * 4096);
+
+    int64_t kept = 0; //Frames whose colors are kept
+    if (imageMode == LOW_RES_FULL && !options.fullPrecision && first <= quantizedFrames) {
+        kept = min(end, QUANTIZED_COLORS_LIMIT / frameColors);
+        quantizedColors.resize(max((int64_t)quantizedColors.size(), kept * frameColors));
+    }
+    int64_t window = frameWindow();
+    for (int64_t x=first; x<end; x+=window) {
+        int64_t count = min(window, end - x);
+        runOnPool(threadCount, threadCount, [&](size_t band) {
+            uint64_t *counts = &bandCounts[band * 4096];
+            vector<WORD> quantized(frameColors);
+            int64_t from = x + count * (int64_t)band / threadCount, to = x + count * ((int64_t)band + 1) / threadCount;
+            for (int64_t frame=from; frame<to; ++frame) {
+                WORD *colors = frame < kept ? &quantizedColors[frame * frameColors] : &quantized[0];
+                quantizeFrame(frame, colors);
+                for (int64_t i=0; i<frameColors; ++i) {
+                    ++counts[colors[i]];
+                }
+            }
+        });
+        releasePixels((x + count) * width);
+    }
+    for (size_t i=0; i<bandCounts.size(); ++i) {
+        colorCounts[i % 4096] += bandCounts[i];
+    }
+    quantizedFrames = max(quantizedFrames, kept);
+}
+
+//Counts the colors of a stream's first options.paletteFrames frames, which stay loaded to be converted, or
+//with 0 of every frame, a window at a time. Converting then reads the stream again from the start.
+void Converter::countStreamColors(uint64_t colorCounts[4096]) {
+    if (options.paletteFrames > 0) {
+        loadFrames(0, options.paletteFrames);
+        countColors(colorCounts);
+        return;
+    }
+    int64_t window = frameWindow();
+    for (int64_t x=0; loadFrames(x, window) > 0; x+=window) {
+        countColors(colorCounts);
+    }
+}
+
+//Fills "palette" from a 12-bit color histogram using the selected algorithm.
+void Converter::choosePalette(const uint64_t colorCounts[4096], int palette[16][3]) {
+    if (options.paletteAlgorithm == MEDIAN_CUT_PALETTE) {
+        medianCutPalette(colorCounts, palette);
+    }
+    else if (options.paletteAlgorithm == K_MEANS_PALETTE) {
+        kMeansPalette(colorCounts, palette);
+    }
+    else {
+        popularPalette(colorCounts, palette);
+    }
+}
+
+//Picks the 16 most common colors.
+void popularPalette(const uint64_t colorCounts[4096], int palette[16][3]) {
+    uint64_t tempCounts[16] = {};
+    unsigned int tempPalette[16] = {};
+
+    //Find 16 most common colors:
+    for (int i=0; i<4096; ++i) {
+        for (int j=0; j<16; ++j) {
+            if (colorCounts[i] > tempCounts[j]) {
+                for (int k=15; k>j; --k) {
+                    tempPalette[k] = tempPalette[k-1];
+                    tempCounts[k] = tempCounts[k-1];
+                }
+                tempPalette[j] = i;
+                tempCounts[j] = colorCounts[i];
+                break;
+            }
+
+        }
+    }
+
+    //Generate current palette format:
+    for (int i=0; i<16; ++i) {
+        palette[i][0] = (tempPalette[i] & 0b111100000000) >> 8;
+        palette[i][1] = (tempPalette[i] & 0b000011110000) >> 4;
+        palette[i][2] = (tempPalette[i] & 0b000000001111);
+    }
+}
+
+//Splits the histogram's colors into up to 16 boxes, repeatedly cutting the box with the most pixels times
+//the widest channel range at its weighted median. Each palette color is the mean of a box. Returns the
+//number of colors used, which is 0 for an empty histogram; the rest of the palette is black.
+int medianCutPalette(const uint64_t colorCounts[4096], int palette[16][3]) {
+    vector<vector<int> > boxes(1);
+    for (int i=0; i<4096; ++i) {
+        if (colorCounts[i] > 0) {
+            boxes[0].push_back(i);
+        }
+    }
+
+    while (boxes.size() < 16) {
+        //Find the box most in need of a cut, and its widest channel:
+        int bestBox = -1, bestChannel = 0;
+        uint64_t bestScore = 0;
+        for (size_t box=0; box<boxes.size(); ++box) {
+            int low[3] = {15, 15, 15}, high[3] = {0, 0, 0};
+            uint64_t count = 0;
+            for (size_t i=0; i<boxes[box].size(); ++i) {
+                int color = boxes[box][i];
+                for (int channel=0; channel<3; ++channel) {
+                    int value = (color >> (8 - 4*channel)) & 0xF;
+                    low[channel] = min(low[channel], value);
+                    high[channel] = max(high[channel], value);
+                }
+                count += colorCounts[color];
+            }
+            for (int channel=0; channel<3; ++channel) {
+                uint64_t score = count * (high[channel] - low[channel]);
+                if (score > bestScore) {
+                    bestScore = score;
+                    bestBox = box;
+                    bestChannel = channel;
+                }
+            }
+        }
+        if (bestBox < 0) {
+            break; //Every box holds a single color
+        }
+
+        //Cut it where half of its pixels are on each side:
+        vector<int> &colors = boxes[bestBox];
+        int shift = 8 - 4*bestChannel;
+        stable_sort(colors.begin(), colors.end(), [shift](int a, int b) {
+            return ((a >> shift) & 0xF) < ((b >> shift) & 0xF);
+        });
+        uint64_t total = 0;
+        for (size_t i=0; i<colors.size(); ++i) {
+            total += colorCounts[colors[i]];
+        }
+        //Only cut between different channel values, as close to the median as possible:
+        size_t cut = 0;
+        uint64_t below = 0, bestImbalance = UINT64_MAX;
+        for (size_t i=1; i<colors.size(); ++i) {
+            below += colorCounts[colors[i-1]];
+            if (((colors[i] >> shift) & 0xF) != ((colors[i-1] >> shift) & 0xF)) {
+                uint64_t imbalance = below * 2 > total ? below * 2 - total : total - below * 2;
+                if (imbalance < bestImbalance) {
+                    bestImbalance = imbalance;
+                    cut = i;
+                }
+            }
+        }
+        vector<int> upper(colors.begin() + cut, colors.end());
+        colors.resize(cut);
+        boxes.push_back(upper); //Invalidates "colors"
+    }
+
+    //Most common boxes first, like the popular palette:
+    vector<pair<uint64_t, int> > order;
+    for (size_t box=0; box<boxes.size(); ++box) {
+        uint64_t count = 0;
+        for (size_t i=0; i<boxes[box].size(); ++i) {
+            count += colorCounts[boxes[box][i]];
+        }
+        order.push_back(make_pair(count, box));
+    }
+    stable_sort(order.begin(), order.end(), [](const pair<uint64_t, int> &a, const pair<uint64_t, int> &b) {
+        return a.first > b.first;
+    });
+
+    memset(palette, 0, sizeof(int) * 16 * 3);
+    int used = 0;
+    for (size_t i=0; i<order.size(); ++i) {
+        const vector<int> &colors = boxes[order[i].second];
+        uint64_t count = order[i].first;
+        if (count == 0) {
+            continue; //The one box of an empty histogram
+        }
+        for (int channel=0; channel<3; ++channel) {
+            uint64_t sum = 0;
+            for (size_t j=0; j<colors.size(); ++j) {
+                sum += colorCounts[colors[j]] * ((colors[j] >> (8 - 4*channel)) & 0xF);
+            }
+            palette[used][channel] = (sum + count/2) / count;
+        }
+        ++used;
+    }
+    return used;
+}
+
+//Refines the median cut palette with k-means over the histogram's distinct colors.
+void kMeansPalette(const uint64_t colorCounts[4096], int palette[16][3]) {
+    int clusters = medianCutPalette(colorCounts, palette);
+    vector<int> colors;
+    for (int i=0; i<4096; ++i) {
+        if (colorCounts[i] > 0) {
+            colors.push_back(i);
+        }
+    }
+    if (clusters == 0) {
+        return;
+    }
+
+    double centers[16][3];
+    for (int i=0; i<clusters; ++i) {
+        for (int channel=0; channel<3; ++channel) {
+            centers[i][channel] = palette[i][channel];
+        }
+    }
+    vector<int> assignment(colors.size(), -1);
+    for (int iteration=0; iteration<32; ++iteration) {
+        //Assign every color to its nearest center:
+        bool changed = false;
+        for (size_t i=0; i<colors.size(); ++i) {
+            int nearest = 0;
+            double nearestDistance = 1e30;
+            for (int j=0; j<clusters; ++j) {
+                double distance = 0;
+                for (int channel=0; channel<3; ++channel) {
+                    double d = ((colors[i] >> (8 - 4*channel)) & 0xF) - centers[j][channel];
+                    distance += d*d;
+                }
+                if (distance < nearestDistance) {
+                    nearestDistance = distance;
+                    nearest = j;
+                }
+            }
+            if (assignment[i] != nearest) {
+                assignment[i] = nearest;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+
+        //Move every center to the weighted mean of its colors:
+        double sums[16][3] = {};
+        double weights[16] = {};
+        for (size_t i=0; i<colors.size(); ++i) {
+            double weight = colorCounts[colors[i]];
+            for (int channel=0; channel<3; ++channel) {
+                sums[assignment[i]][channel] += weight * ((colors[i] >> (8 - 4*channel)) & 0xF);
+            }
+            weights[assignment[i]] += weight;
+        }
+        for (int j=0; j<clusters; ++j) {
+            if (weights[j] > 0) {
+                for (int channel=0; channel<3; ++channel) {
+                    centers[j][channel] = sums[j][channel] / weights[j];
+                }
+            }
+        }
+    }
+
+    for (int i=0; i<clusters; ++i) {
+        for (int channel=0; channel<3; ++channel) {
+            palette[i][channel] = min(15, (int)(centers[i][channel] + 0.5));
+        }
+    }
+}
+
+//Generates the DCPU for the custom font space, depending on the font width required
+void Converter::genFontSpace(int imageMode) {
+
+    //Set up custom low res font space:
+    if (imageMode == LOW_RES_FULL) {
+        emitText("0x0f0f, 0x0f0f\n");
+    }
+
+    //Set up custom full high res font space:
+    else if (imageMode == HIGH_RES_FULL) {
+        int decValues[4] = {0, 3, 12, 15};
+        for (int i=0; i<4; ++i) {
+            for (int j=0; j<4; ++j) {
+                for (int k=0; k<4; ++k) {
+                    for (int l=0; l<2; ++l) {
+                        WORD ij = decValues[i] * 16 + decValues[j];
+                        WORD kl = decValues[k] * 16 + decValues[l];
+                        emitWord(ij * 256 + ij);
+                        emitWord(kl * 256 + kl);
+                    }
+                }
+            }
+        }
+    }
+
+    //Sets up custom highres "letter space":
+    else if (imageMode == HIGH_RES_SMALL) {
+        for (int i=0; i<64; ++i) {
+            emitWord(0x0000);
+        }
+        for (int i=0; i<8; ++i) {
+            for (int j=0; j<8; ++j) {
+                emitWord(0x0000);
+            }
+            for (int j=0; j<16; ++j) {
+                int charIndex = i*16 + j;
+                emitWord(0x0100 + charIndex);
+            }
+            for (int j=0; j<8; ++j) {
+                emitWord(0x0000);
+            }
+        }
+        for (int i=0; i<64; ++i) {
+            emitWord(0x0000);
+        }
+    }
+}
+
+void Converter::genPaletteSpace() {
+    for (int i=0; i<16; ++i) {
+        int r, g, b;
+        r = currentPalette[i][0];
+        g = currentPalette[i][1];
+        b = currentPalette[i][2];
+        emitWord(r * 256 + g * 16 + b);
+    }
+}
+
+//Generates the DCPU word for two vertically adjacent BMP pixels (one DCMP tile).
+WORD Converter::generateLowResTile(RGBTRIPLE firstPixel, RGBTRIPLE secondPixel) {
+
+    //Find the closest allowable hex value for each color:
+    int fRGB = roundColorToPalette(firstPixel);
+    int sRGB = roundColorToPalette(secondPixel);
+
+    return fRGB * 4096 + sRGB * 256;
+}
+
+//Generates the High Res Full Size tile at "column" and "row" of a thresholded frame when using the higher
+//resolution 7-bit font width. The 2x4 block of black pixels indexes the table of tile words.
+WORD generateHighResFullTile(const uint64_t *plane, int column, int row) {
+    int tile = (plane[row] >> column & 3) | (plane[row + 1] >> column & 3) << 2 |
+               (plane[row + 2] >> column & 3) << 4 | (plane[row + 3] >> column & 3) << 6;
+    return bitPlaneTables.fullTiles[tile];
+}
+
+//Generates the two font words of the High Res Small Size tile at "column" and "row" of a thresholded frame
+//when using the higher resolution 7-bit font width. Each font byte is one column of the 4x8 cell, with the top
+//pixel in bit 0, so the 4 bits of each row are spread across the bytes and shifted into place.
+void generateHighResSmallTile(const uint64_t *plane, int column, int row, WORD glyph[2]) {
+    uint32_t columns = 0;
+    for (int j=0; j<8; ++j) {
+        columns |= bitPlaneTables.spreadBits[plane[row + j] >> column & 0xF] << j;
+    }
+    glyph[0] = (columns & 0xFF) << 8 | (columns >> 8 & 0xFF);
+    glyph[1] = (columns >> 16 & 0xFF) << 8 | columns >> 24;
+}
+
+//Returns the --stats report of the image that was just converted to "outputFilename", as a JSON object. Stage
+//times are in seconds, the allocation counts are those made since the conversion began (-1 when they can't be
+//told apart from other conversions', reported as null), and "peakMemory" is the peak resident memory of the
+//process.
+string Converter::statsReport(const string &imageFilename, const string &outputFilename, double readTime,
+                              double saveTime, double totalTime, int64_t allocations, int64_t bytes,
+                              uint64_t peakMemory) {
+    static const char *modeNames[] = {"32x24", "64x48", "64x64"};
+    static const char *metricNames[] = {"manhattan", "euclidean", "perceptual"};
+    static const char *regionLabels[] = {"font_space", "palette_space", "tile_space", "packed_space", "delta_space",
+                                         "frame_table", "frame_space", "hold_table"};
+
+    //Assembling the program below runs the stages again, so their times are taken first:
+    stringstream seconds;
+    seconds << fixed << setprecision(6) << "{\"read\": " << readTime << ", \"palette\": " << paletteSeconds
+            << ", \"tiles\": " << tileSeconds << ", \"emit\": "
+            << max(0.0, saveTime - paletteSeconds - tileSeconds - writeSeconds) << ", \"write\": " << writeSeconds
+            << ", \"total\": " << totalTime << "}";
+
+    //Region sizes come from the labels of the assembled program. Each region runs to the next region, to
+    //exit or to the end, and everything else is player code.
+    stringstream words;
+    vector<WORD> program;
+    if (assembleProgram(program)) {
+        vector<uint32_t> bounds(1, wordAddress);
+        for (size_t i=0; i<sizeof(regionLabels) / sizeof(regionLabels[0]); ++i) {
+            if (labels.count(regionLabels[i])) {
+                bounds.push_back(labels[regionLabels[i]]);
+            }
+        }
+        if (labels.count("exit")) {
+            bounds.push_back(labels["exit"]);
+        }
+        uint32_t dataWords = 0;
+        for (size_t i=0; i<sizeof(regionLabels) / sizeof(regionLabels[0]); ++i) {
+            if (labels.count(regionLabels[i])) {
+                uint32_t start = labels[regionLabels[i]], end = wordAddress;
+                for (size_t j=0; j<bounds.size(); ++j) {
+                    if (bounds[j] > start) {
+                        end = min(end, bounds[j]);
+                    }
+                }
+                words << "\"" << regionLabels[i] << "\": " << end - start << ", ";
+                dataWords += end - start;
+            }
+        }
+        words << "\"player\": " << wordAddress - dataWords << ", \"total\": " << wordAddress << ", \"limit\": 65536";
+    }
+
+    //Colors are measured on the 12-bit histogram. Only full color images have a palette to measure the error
+    //of, in the units of the color metric:
+    uint64_t colorCounts[4096] = {};
+    countColors(colorCounts);
+    int uniqueColors = 0;
+    uint64_t pixels = 0;
+    double errorTotal = 0, errorMax = 0;
+    for (int color=0; color<4096; ++color) {
+        if (colorCounts[color] == 0) {
+            continue;
+        }
+        ++uniqueColors;
+        pixels += colorCounts[color];
+        if (imageMode == LOW_RES_FULL) {
+            double error = colorDistance((color >> 8) << 4, ((color >> 4) & 0xF) << 4, (color & 0xF) << 4,
+                                         paletteLookup[color]);
+            if (options.colorMetric != MANHATTAN_METRIC) {
+                error = sqrt(error);
+            }
+            errorTotal += error * colorCounts[color];
+            errorMax = max(errorMax, error);
+        }
+    }
+
+    stringstream report;
+    report << fixed << setprecision(6);
+    report << "{\"image\": " << jsonString(imageFilename) << ", \"output\": " << jsonString(outputFilename)
+           << ", \"mode\": \"" << modeNames[imageMode]
+           << "\", \"frames\": " << (animationFlag ? bih.biWidth / frameWidth() : 1) << ",\n"
+           << " \"seconds\": " << seconds.str() << ",\n"
+           << " \"peak_rss_bytes\": " << peakMemory << ", \"allocations\": ";
+    if (allocations >= 0) {
+        report << allocations << ", \"allocated_bytes\": " << bytes << ",\n";
+    }
+    else {
+        report << "null, \"allocated_bytes\": null,\n";
+    }
+    report << " \"words\": {" << words.str() << "},\n"
+           << " \"unique_colors\": " << uniqueColors << ",\n"
+           << " \"quantization_error\": ";
+    if (imageMode == LOW_RES_FULL) {
+        report << "{\"metric\": \"" << metricNames[options.colorMetric] << "\", \"mean\": " << errorTotal / pixels
+               << ", \"max\": " << errorMax << "}";
+    }
+    else {
+        report << "null";
+    }
+    //Frames loaded from and added to the cache directory by saveFile, before the assembly above:
+    report << ",\n \"frame_cache\": ";
+    if (!options.cacheDir.empty()) {
+        report << "{\"hits\": " << flushedHits << ", \"misses\": " << flushedMisses << ", \"bytes_added\": "
+               << flushedBytes << "}}";
+    }
+    else {
+        report << "null}";
+    }
+    return report.str();
+}
+
+//Quotes "text" as a JSON string. Control characters can't appear in one as they are, so they're escaped too.
+string jsonString(const string &text) {
+    static const char hexDigits[] = "0123456789abcdef";
+    string quoted = "\"";
+    for (size_t i=0; i<text.size(); ++i) {
+        BYTE c = text[i];
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (c == '\n') {
+            quoted += "\\n";
+        }
+        else if (c == '\t') {
+            quoted += "\\t";
+        }
+        else if (c == '\r') {
+            quoted += "\\r";
+        }
+        else if (c < 0x20) {
+            quoted += "\\u00";
+            quoted += hexDigits[c >> 4];
+            quoted += hexDigits[c & 0xF];
+        }
+        else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+//One worker per core.
+unsigned int defaultThreadCount() {
+    unsigned int threadCount = thread::hardware_concurrency();
+    return threadCount == 0 ? 1 : threadCount;
+}
+
+//Runs job(0) to job(jobCount - 1) on "threadCount" threads, each taking the next job as it finishes one.
+void runOnPool(size_t jobCount, unsigned int threadCount, const function<void(size_t)> &job) {
+    atomic<size_t> nextJob(0);
+    auto worker = [&]() {
+        for (size_t i = nextJob++; i < jobCount; i = nextJob++) {
+            job(i);
+        }
+    };
+    if (threadCount <= 1) {
+        worker();
+        return;
+    }
+    vector<thread> workers;
+    for (unsigned int i=0; i<threadCount; ++i) {
+        workers.push_back(thread(worker));
+    }
+    for (size_t i=0; i<workers.size(); ++i) {
+        workers[i].join();
+    }
+}
+
+//Seconds since "start".
+double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
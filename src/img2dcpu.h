@@ -0,0 +1,362 @@
+/*
+  img2dcpu - A utility for converting an image into DCPU assembly code for 0x10c.
+
+  Copyright 2012 Tyler Crumpton.
+  This utility is licensed under a GPLv3 License (see COPYING).
+  Source at: https://github.com/tac0010/img2dcpu
+
+  The converter library. A Converter holds everything about one conversion (its image, mode, palette and
+  output), so any number of them can run side by side in one process. main.cpp is the command line over it.
+*/
+
+#ifndef IMG2DCPU_H
+#define IMG2DCPU_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#ifdef __WIN32__
+    #include <windows.h>
+#else
+    typedef int HANDLE;
+
+    typedef unsigned char BYTE;
+    typedef BYTE BOOLEAN;
+    typedef BOOLEAN boolean;
+    typedef uint32_t DWORD;
+    typedef int32_t LONG;
+    typedef uint16_t WORD;
+
+    #pragma pack(push, 2)
+
+    // from Wingdi.h
+    typedef struct tagBITMAPFILEHEADER {
+        WORD  bfType;
+        DWORD bfSize;
+        WORD  bfReserved1;
+        WORD  bfReserved2;
+        DWORD bfOffBits;
+    } BITMAPFILEHEADER, *PBITMAPFILEHEADER;
+
+    typedef struct tagBITMAPINFOHEADER {
+        DWORD biSize;
+        LONG  biWidth;
+        LONG  biHeight;
+        WORD  biPlanes;
+        WORD  biBitCount;
+        DWORD biCompression;
+        DWORD biSizeImage;
+        LONG  biXPelsPerMeter;
+        LONG  biYPelsPerMeter;
+        DWORD biClrUsed;
+        DWORD biClrImportant;
+    } BITMAPINFOHEADER, *PBITMAPINFOHEADER;
+
+    typedef struct tagRGBTRIPLE {
+        BYTE rgbtBlue;
+        BYTE rgbtGreen;
+        BYTE rgbtRed;
+    } RGBTRIPLE;
+
+    #pragma pack(pop)
+
+#endif
+
+enum {LOW_RES_FULL, HIGH_RES_FULL, HIGH_RES_SMALL};
+
+const int LOW_RES_FULL_W = 32;
+const int LOW_RES_FULL_H = 24;
+const int HIGH_RES_FULL_W = 64;
+const int HIGH_RES_FULL_H = 48;
+const int HIGH_RES_SMALL_W = 64;
+const int HIGH_RES_SMALL_H = 64;
+
+//Output formats. The binary formats are DCPU memory images, assembled as the program is emitted.
+enum {TEXT_OUTPUT, BINARY_LITTLE_ENDIAN, BINARY_BIG_ENDIAN};
+
+//Distance metrics for matching colors to the palette.
+enum {MANHATTAN_METRIC, EUCLIDEAN_METRIC, PERCEPTUAL_METRIC};
+
+//Codecs that frame data can be packed with, unpacked on the DCPU by a matching routine in the program.
+enum {NO_CODEC, RLE_CODEC, LZ_CODEC};
+extern const char *codecNames[];
+
+//Palette generators.
+enum {POPULAR_PALETTE, MEDIAN_CUT_PALETTE, K_MEANS_PALETTE};
+
+//How frames of another size are fitted to a mode's frames when they're resampled, and the filters they can be
+//resampled with.
+enum {LETTERBOX_FIT, CROP_FIT, STRETCH_FIT};
+enum {BOX_FILTER, LANCZOS_FILTER};
+
+//How images are converted. The same options can be shared by any number of converters.
+struct ConverterOptions {
+    int outputFormat = TEXT_OUTPUT;
+    int colorMetric = MANHATTAN_METRIC;
+    bool fullPrecision = false;  //Match every pixel's 24-bit color instead of using the 12-bit lookup table
+    int paletteAlgorithm = POPULAR_PALETTE;
+
+    //A palette shared by every image, used instead of choosing one per image when sharedPaletteReady is set.
+    bool sharedPaletteReady = false;
+    int sharedPalette[16][3] = {};
+
+    //Animations can be stored as a keyframe plus the runs of words that change from each frame to the next,
+    //as each distinct frame once played through a table of frame offsets, or for centered animations as the
+    //screen cells of each frame pointing into a shared dictionary of glyphs. At most one of these is set.
+    bool deltaEncoding = false;
+    bool frameDedup = false;
+    bool glyphDictionary = false;
+    int packingCodec = NO_CODEC;
+
+    //Animations can be timed by the generic clock at a given frame rate instead of by a busy-wait, with
+    //optional hold times for single frames (frame -> milliseconds).
+    double framesPerSecond = 0;
+    std::map<int64_t, int> frameHoldMs;
+
+    //The most words the program may take, or 0 for no limit. planProgram() fits the program into them by
+    //choosing the layout, and by dropping frames or changing modes when no layout is small enough.
+    uint32_t maxWords = 0;
+
+    //Threads that each conversion splits its frames and colors across, or 0 for one per core.
+    unsigned int workerThreads = 0;
+
+    //A directory where converted frames are kept between runs, shared by any number of processes, and the
+    //size it's trimmed back under. No frames are cached when it's empty.
+    std::string cacheDir;
+    uint64_t cacheLimitBytes = 256 << 20;
+
+    //Images can be resampled to the frames of a mode when they aren't that size already, cut into
+    //sourceFrames frames from left to right (0 for one, unless the image is already a strip of that mode's
+    //frames). resampleMode is -1 to only take images of the supported sizes.
+    int resampleMode = -1;
+    int64_t sourceFrames = 0;
+
+    //The frames can be laid out as a sprite sheet of sheetColumns by sheetRows frames instead of in one row,
+    //taken left to right and then top to bottom, sourceFrames of them (0 for every cell). One column with 0
+    //rows is a vertical strip, its frames as tall as the mode's. Both 0 for one row.
+    int sheetColumns = 0;
+    int sheetRows = 0;
+    int fitPolicy = LETTERBOX_FIT;
+    int resampleFilter = BOX_FILTER;
+
+    //A streamed animation's palette is chosen from its first paletteFrames frames, which are held in memory
+    //until they're converted, or with 0 from all of its frames, reading the stream twice.
+    int64_t paletteFrames = 256;
+};
+
+struct FrameStream;
+
+//Converts one image at a time into a DCPU program. Load an image with readImage() or setPixels(), or open a
+//stream of frames with openStream(), pick its mode with selectImageMode(), then write the program with
+//saveFile() or saveStream(), or assemble it into memory with assembleProgram(). A stream is read as the
+//program is written, so it can't be verified or reported on afterwards. A converter is used by one thread at
+//a time.
+class Converter {
+public:
+    Converter(const ConverterOptions &converterOptions);
+    ~Converter();
+    Converter(const Converter &) = delete;
+    Converter &operator=(const Converter &) = delete;
+
+    bool readImage(const char *filename);
+    bool setPixels(const BYTE *pixels, int width, int height, int64_t stride);
+    bool openStream(FILE *input, int rawWidth, int rawHeight);
+    void closeImage();
+    int selectImageMode(std::ostream &log);
+    int planProgram(std::ostream &log);
+    bool saveFile(const char *filename);
+    bool saveStream(std::ostream &out);
+    int64_t updateFile(const char *imageFilename, const char *outputFilename, bool &patched);
+    bool assembleProgram(std::vector<WORD> &memory);
+    bool assembleText(const std::string &text, std::vector<WORD> &memory);
+    int64_t measureProgram();
+    int verifyProgram(std::ostream &log);
+    void reportCodecs(int64_t frames, std::ostream &log);
+    std::string statsReport(const std::string &imageFilename, const std::string &outputFilename, double readTime,
+                            double saveTime, double totalTime, int64_t allocations, int64_t bytes,
+                            uint64_t peakMemory);
+
+    //Conversion stages, used directly by the benchmark:
+    void releasePixels(int64_t endColumn);
+    void generateDCPUFull();
+    void generateDCPUSmall();
+    int frameWidth();
+    int frameWordCount();
+    int64_t frameCount();
+    int64_t loadFrames(int64_t first, int64_t count);
+    void convertFrame(int64_t x, WORD *words);
+    void thresholdFrame(int64_t x, uint64_t *plane);
+    void convertFrames(int64_t first, int64_t count, WORD *words);
+    int64_t frameWindow();
+    void generateColorPalette();
+    void countColors(uint64_t colorCounts[4096]);
+    void choosePalette(const uint64_t colorCounts[4096], int palette[16][3]);
+
+    //Returns the pixel at "column" across and "row" down from the top left of the image. When the frames are
+    //stored one after another, the column's frame is column >> frameShift.
+    inline const RGBTRIPLE &pixel(int64_t column, int64_t row) const {
+        column -= firstColumn;
+        return *(const RGBTRIPLE *)(topRow + row * rowStride + (column >> frameShift) * frameStride +
+                                    (column & frameMask) * 3);
+    }
+
+    ConverterOptions options;
+
+    //The image. Bitmap files are mapped in place; pixels given by setPixels() belong to the caller.
+    HANDLE hfile;
+    BITMAPFILEHEADER bfh;
+    BITMAPINFOHEADER bih;
+    const BYTE *mapping;  //The whole bitmap file, mapped read-only
+    int64_t mappingSize;
+    const BYTE *topRow;   //First pixel of the top row
+    int64_t rowStride;    //Bytes from one row to the next one down (negative for bottom-up bitmaps)
+
+    //Frames of a vertical strip are read in place, one after another, and those of a sprite sheet or that are
+    //resampled or streamed are gathered that way, so each frame's pixels are together. A strip in one row is
+    //read in place, its frames side by side, with a frameStride of 0.
+    int64_t frameStride;  //Bytes from one frame to the next
+    int frameShift;       //The width of the frames is 1 << frameShift, when it's a power of 2
+    int64_t frameMask;
+    std::vector<BYTE> framePixels; //Gathered or resampled frames, in place of the bitmap's pixels
+
+    //Full color frames are quantized to 12-bit colors once, while the colors are counted for the palette, a
+    //window of frames at a time. The colors of frames 0 to quantizedFrames - 1 are kept, up to the limit, and
+    //their tiles are made from them without reading the pixels again.
+    static const int64_t QUANTIZED_COLORS_LIMIT = 1 << 23; //16 MB
+    std::vector<WORD> quantizedColors;
+    int64_t quantizedFrames;
+
+    //The planner keeps only every frameStep-th frame of an animation of unsteppedFrames frames, by reading the
+    //frames frameStep times further apart than unsteppedStride, the frameStride they were read with.
+    int frameStep;
+    int64_t unsteppedFrames;
+    int64_t unsteppedStride;
+
+    //A stream of frames read instead of a bitmap, a window at a time. Only the frames from column firstColumn
+    //of the image are in memory then, and bih.biWidth ends after the last of them.
+    FrameStream *stream;
+    int64_t firstColumn;  //Column of the image at topRow
+    int64_t streamFrames; //Frames read from the stream, which is all of them once the program is written
+
+    bool animationFlag;
+    int imageMode;
+    int currentPalette[16][3];
+
+    //Nearest palette index for every 12-bit color, built once per palette.
+    BYTE paletteLookup[4096];
+    float paletteLab[16][3];
+
+    int64_t uniqueFrames; //Frames stored by the last deduplicated animation
+    int64_t fontCount;    //Fonts in the last glyph dictionary
+
+    //Assembly output is formatted straight into a fixed buffer that is written out whenever it fills.
+    static const int OUTPUT_BUFFER_SIZE = 1 << 16;
+    char outputBuffer[OUTPUT_BUFFER_SIZE];
+    int outputUsed;
+    int64_t outputWritten;      //Bytes written to outputFile so far
+    bool outputFailed;
+    HANDLE outputFile;
+    std::ostream *outputStream; //Set while text is written to a stream instead of outputFile
+
+    //Assembler state for binary output. Label operands always take a next word, so instruction sizes are
+    //known before the labels are, and the words are patched into the file once everything has been written.
+    std::string pendingLine;     //Assembly text received since the last end of line
+    bool datLine;                //The current line is a DAT whose values are arriving as words
+    uint32_t wordAddress;        //DCPU address of the next word written (in assembly text, DAT words written)
+    std::map<std::string, uint32_t> labels;
+    std::vector<std::pair<uint32_t, std::string> > fixups; //Addresses of words that hold a label's value
+    std::string assemblerError;
+    std::vector<WORD> *memoryImage; //Set while assembling into memory instead of a file
+
+    double paletteSeconds, tileSeconds, writeSeconds; //Time spent in each stage of saveFile
+
+    //With cacheFrames set, the words of every frame are kept along with its 128-bit cache key, the one the
+    //cache directory files it under, and a frame is only converted again once its pixels or the palette change.
+    //The cache is reset whenever the mode, frame count or palette differs from the one it was filled with.
+    bool cacheFrames;
+    std::vector<WORD> frameCache;
+    std::vector<uint64_t> frameKeys; //Two words for each frame
+    std::vector<BYTE> frameCached;  //Whether each frame's words are in frameCache
+    int cacheMode;
+    int cachePalette[16][3];
+    int64_t convertedFrames;        //Frames converted rather than taken from the cache
+    int64_t frameDataOffset;        //Byte offset of the first frame in the output file, or -1 if the frames
+                                    //aren't all stored in full at fixed places
+
+    //Frames loaded from and added to the cache directory since the converter was created. Those up to
+    //flushedHits and flushedMisses, and flushedBytes of the bytes added, are in the cache's totals.
+    std::atomic<int64_t> cacheHits, cacheMisses, cacheBytesAdded;
+    int64_t flushedHits, flushedMisses, flushedBytes;
+
+private:
+    //Whether emitted text and words go to the assembler rather than straight into a text file.
+    inline bool assemblingOutput() const {
+        return options.outputFormat != TEXT_OUTPUT || memoryImage != NULL;
+    }
+
+    unsigned int workerCount();
+    void runWorkers(size_t jobCount, const std::function<void(size_t)> &job);
+    bool openOutput(const char *filename);
+    void flushOutput();
+    bool closeOutput(const char *filename);
+    void emitText(const char *text);
+    void emitWord(WORD word);
+    void bufferBinaryWord(WORD word);
+    void startAssembly(std::vector<WORD> &memory);
+    bool finishAssembly();
+    void assembleLine(const std::string &line);
+    bool resolveLabels(const char *filename);
+    void expectedScreen(int64_t x, WORD *pixels);
+    int roundColorToPalette(RGBTRIPLE color);
+    int nearestPaletteColor(int red, int green, int blue);
+    float colorDistance(int red, int green, int blue, int paletteIndex);
+    void buildPaletteLookup();
+    void genFontSpace(int imageMode);
+    void genPaletteSpace();
+    void setupMonitor();
+    void emitDelay();
+    int frameHold(int64_t x);
+    void emitFrames(int64_t frames);
+    void emitDeltaPlayer(const char *screenLabel);
+    void emitDeltaFrames(int64_t frames);
+    void emitIndexedPlayer(const char *screenLabel);
+    void emitUniqueFrames(int64_t frames);
+    void emitGlyphPlayer();
+    void emitGlyphFrames(int64_t frames);
+    void emitCodecPlayer(const char *screenLabel, int mapCommand);
+    void emitUnpackRoutine();
+    void emitPackedFrames(int64_t frames);
+    uint64_t hashFramePixels(int64_t x);
+    bool framePixelsEqual(int64_t x, int64_t y);
+    WORD generateLowResTile(RGBTRIPLE firstPixel, RGBTRIPLE secondPixel);
+    void quantizeFrame(int64_t x, WORD *colors);
+    void setFrameLayout(const BYTE *firstRow, int width, int64_t stride, int64_t frameBytes);
+    void setFrameStep(int step, const ConverterOptions &given);
+    int programLayout();
+    void setProgramLayout(int layout);
+    const BYTE *frameTop(int64_t x, int width);
+    int64_t gatherFrames(std::ostream &log);
+    bool resampleImage(int64_t frames, std::ostream &log);
+    int selectStreamMode(std::ostream &log);
+    void countStreamColors(uint64_t colorCounts[4096]);
+    void prepareFrameCache(int64_t frames);
+    bool convertCachedFrame(int64_t x, WORD *words);
+    void frameCacheKey(int64_t x, uint64_t key[2]);
+    void flushCacheStats();
+};
+
+int64_t packFrame(const WORD *words, int count, int codec, std::vector<WORD> &packed);
+int roundColorValue(RGBTRIPLE color);
+void quantizeColors(const BYTE *bytes, int64_t count, WORD *colors);
+unsigned int defaultThreadCount();
+void runOnPool(size_t jobCount, unsigned int threadCount, const std::function<void(size_t)> &job);
+double secondsSince(std::chrono::steady_clock::time_point start);
+
+#endif
@@ -15,695 +15,1250 @@
   April 13, 2012 - v0.1: Initial Release. Only works with 24-bit bitmaps.
 */
 
-#include <iostream>
-#include <fstream>
-#include <sstream>
+#include "img2dcpu.h"
+
 #include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sys/stat.h>
 
 #ifdef __WIN32__
-    #include <windows.h>
+    #define PSAPI_VERSION 2
+    #include <psapi.h>
+    #include <io.h>
+    #include <fcntl.h>
 #else
     #include <unistd.h>
+    #include <dirent.h>
+    #include <glob.h>
+    #include <sys/resource.h>
+#endif
 
-    typedef FILE* HANDLE;
-
-    typedef unsigned char BYTE;
-    typedef BYTE BOOLEAN;
-    typedef BOOLEAN boolean;
-    typedef uint32_t DWORD;
-    typedef int32_t LONG;
-    typedef uint16_t WORD;
-
-    #pragma pack(push, 2)
-
-    // from Wingdi.h
-    typedef struct tagBITMAPFILEHEADER {
-        WORD  bfType;
-        DWORD bfSize;
-        WORD  bfReserved1;
-        WORD  bfReserved2;
-        DWORD bfOffBits;
-    } BITMAPFILEHEADER, *PBITMAPFILEHEADER;
-
-    typedef struct tagBITMAPINFOHEADER {
-        DWORD biSize;
-        LONG  biWidth;
-        LONG  biHeight;
-        WORD  biPlanes;
-        WORD  biBitCount;
-        DWORD biCompression;
-        DWORD biSizeImage;
-        LONG  biXPelsPerMeter;
-        LONG  biYPelsPerMeter;
-        DWORD biClrUsed;
-        DWORD biClrImportant;
-    } BITMAPINFOHEADER, *PBITMAPINFOHEADER;
-
-    typedef struct tagRGBTRIPLE {
-        BYTE rgbtBlue;
-        BYTE rgbtGreen;
-        BYTE rgbtRed;
-    } RGBTRIPLE;
-
-    #pragma pack(pop)
-
+#ifdef __linux__
+    #include <sys/inotify.h>
 #endif
 
 using namespace std;
 
-void readImage(char *filename);
-void saveFile(char *filename);
-string generateLowResTile(int index, RGBTRIPLE firstPixel, RGBTRIPLE secondPixel);
-string int2hex(int i, int width);
-int roundColorValue(RGBTRIPLE color);
-int roundColorToPalette(RGBTRIPLE color);
-string genFontSpace(int imageMode);
-string generateDCPUFull();
-string generateDCPUSmall();
-string generateHighResFullTile(int pxIndex, int imgIndex);
-string generateHighResSmallTile(int pxIndex, int imgIndex);
-void generateColorPalette();
-string setupMonitor();
-string genPaletteSpace();
-
-HANDLE hfile;
-DWORD written;
-BITMAPFILEHEADER bfh;
-BITMAPINFOHEADER bih;
-RGBTRIPLE *image;
-
-
-enum {LOW_RES_FULL, HIGH_RES_FULL, HIGH_RES_SMALL};
-
-const int LOW_RES_FULL_W = 32;
-const int LOW_RES_FULL_H = 24;
-const int HIGH_RES_FULL_W = 64;
-const int HIGH_RES_FULL_H = 48;
-const int HIGH_RES_SMALL_W = 64;
-const int HIGH_RES_SMALL_H = 64;
-
-bool animationFlag = false;
-int imageMode;
-int centerOffset = 64 + 8;
-
-int currentPalette[16][3] = {};
+int convertFile(const string &imageFilename, const string &outputFilename, ostream &log);
+string conversionError(const string &log, int result);
+int runBatch(const string &outputDir, const vector<string> &inputs, unsigned int threadCount);
+int runWatch(const string &imageFilename, const string &outputFilename);
+bool isStreamInput(const string &filename);
+void expandInputs(const string &input, vector<string> &files);
+int runBenchmark(const vector<string> &inputs);
+bool writeSyntheticBitmap(const string &filename, int width, int height, int64_t frames);
+uint64_t peakMemoryBytes();
+bool writeStats(bool batch);
+
+//Conversion options from the command line, shared by every converter.
+ConverterOptions options;
+bool globalPalette = false; //One palette is shared by every image in a batch
+bool codecReport = false;
+
+//Frames can be streamed from stdin or a file instead of a bitmap: Y4M, or raw 24-bit RGB frames of this size.
+int rawWidth = 0, rawHeight = 0;
+
+//The generated program can be run on a built-in DCPU and checked against the image.
+bool verifyOutput = false;
+
+//Benchmark settings: frame counts of the synthetic images, and baseline files to save to and compare with.
+vector<int64_t> benchFrameCounts = {1, 10, 100, 1000, 10000, 100000};
+string benchSaveFile;
+string benchCompareFile;
+volatile int benchSink; //Keeps the bitmap reads in the benchmark from being optimized away
+
+//--stats reports every conversion as JSON, to statsFile or after the log. Allocations are counted for it by
+//the replacement operator new below, across the whole process, so a batch only reports them for the whole run.
+//Every form of new and delete is replaced, so that memory from the library's nothrow and aligned news (such as
+//the buffer of stable_sort) is freed by the delete that matches it.
+bool statsEnabled = false;
+bool statsBatch = false;
+string statsFile;
+mutex statsMutex;
+vector<string> statsReports;
+atomic<uint64_t> allocationCount(0);
+atomic<uint64_t> allocatedBytes(0);
+
+void *operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    void *memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL) {
+        throw bad_alloc();
+    }
+    return memory;
+}
 
-int main (int argc, char **argv) {
+//The deletes aren't inlined, so that the compiler doesn't pair the free with a new expression and warn about it:
+#ifdef __GNUC__
+    #define NOT_INLINED __attribute__((noinline))
+#else
+    #define NOT_INLINED
+#endif
 
-    //Checks to see if only one argument is supplied:
-    if (argc > 3) {
-        cout << "Too many arguments. Please run 'img2dcpu -help' for list of applicable arguments.";
-        return -1;
-    }
+void *operator new[](size_t size) {
+    return operator new(size);
+}
 
-    //Display the help message
-    if (argc == 1 || string(argv[1]) == "-help")
-    {
-        cout << "Converts a 24-bit bitmap image into DCPU code for 0x10c.\n\n";
-        cout << "img2dcpu [imagefilename] [outputfilename]\n\n";
-        cout << "imagefilename   The filename of the bitmap image that is to be converted.\n";
-        cout << "outputfilename  The filename of the text file that will contain the DCPU code.\n\n";
-        cout << "In order to generate an animation, you must input an image contains all frames,\n";
-        cout << "in order, from left to right. Each frame must have a resolution supported by\n";
-        cout << "img2dcpu. See the /examples folder for some sample images.\n\n";
-        cout << "Note: img2dcpu currently only works with 32x24 color, 64x48 or 64x64 b&w images.\n";
-        return 0;
+NOT_INLINED void operator delete(void *memory) noexcept {
+    free(memory);
+}
+
+NOT_INLINED void operator delete(void *memory, size_t) noexcept {
+    free(memory);
+}
+
+NOT_INLINED void operator delete[](void *memory) noexcept {
+    free(memory);
+}
+
+NOT_INLINED void operator delete[](void *memory, size_t) noexcept {
+    free(memory);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+    try {
+        return operator new(size);
     }
+    catch (const bad_alloc &) {
+        return NULL;
+    }
+}
 
-    if (argc == 3) { // All arguments are included
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+    return operator new(size, nothrow);
+}
 
-        cout << "Loading image...";
-        readImage(argv[1]); //Read in the bitmap image
-        cout << " Done.\n\n";
-        cout << " Image Width : " << bih.biWidth << "\n";  //Will output the width of the bitmap
-        cout << "Image Height : " << bih.biHeight << "\n"; //Will output the height of the bitmap
+NOT_INLINED void operator delete(void *memory, const nothrow_t &) noexcept {
+    free(memory);
+}
 
-        if (bih.biWidth == 32 && bih.biHeight == 24) {
-            imageMode = LOW_RES_FULL;
-            animationFlag = false;
-            cout << "   Mode Used : 32x24 Full Color, Full Screen.\n";
-        }
-        else if (bih.biWidth % 32 == 0 && bih.biHeight == 24) {
-            imageMode = LOW_RES_FULL;
-            animationFlag = true;
-            cout << "   Mode Used : 32x24 Full Color, Full Screen, Animated.\n";
-        }
-        else if (bih.biWidth == 64 && bih.biHeight == 48) {
-            imageMode = HIGH_RES_FULL;
-            animationFlag = false;
-            cout << "   Mode Used : 64x48 Black and White, Full Screen.\n";
-        }
-        else if (bih.biWidth % 64 == 0 && bih.biHeight == 48) {
-            imageMode = HIGH_RES_FULL;
-            animationFlag = true;
-            cout << "   Mode Used : 64x48 Black and White, Full Screen, Animated.\n";
-        }
-        else if (bih.biWidth == 64 && bih.biHeight == 64) {
-            imageMode = HIGH_RES_SMALL;
-            animationFlag = false;
-            cout << "   Mode Used : 64x64 Black and White, Centered.\n";
-        }
-        else if (bih.biWidth % 64 == 0 && bih.biHeight == 64) {
-            imageMode = HIGH_RES_SMALL;
-            animationFlag = true;
-            cout << "   Mode Used : 64x64 Black and White, Centered, Animated.\n";
-        }
-        else {
-            cout << "\nError: img2dcpu currently only supports 32x24 color or 64x48/64x64 b&w images.";
-            return 2;
-        }
+NOT_INLINED void operator delete[](void *memory, const nothrow_t &) noexcept {
+    free(memory);
+}
 
-        cout << "\nGenerating DCPU file...";
-        saveFile(argv[2]);
-        cout << " Done.\n";
+//Over-aligned types are new'd with their alignment since C++17. Windows has to free such memory itself:
+#ifdef __cpp_aligned_new
+void *operator new(size_t size, align_val_t alignment) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    #ifdef __WIN32__
+        void *memory = _aligned_malloc(size == 0 ? 1 : size, (size_t)alignment);
+    #else
+        void *memory = NULL;
+        if (posix_memalign(&memory, max((size_t)alignment, sizeof(void*)), size == 0 ? 1 : size) != 0) {
+            memory = NULL;
+        }
+    #endif
+    if (memory == NULL) {
+        throw bad_alloc();
     }
+    return memory;
+}
 
-    else { // If only one argument is included, error
-        cout << "\nEither image or save file was not specified; file will not be saved.\n";
-        return 1;
+void *operator new[](size_t size, align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void *operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept {
+    try {
+        return operator new(size, alignment);
     }
+    catch (const bad_alloc &) {
+        return NULL;
+    }
+}
 
-    return 0; //exit
+void *operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept {
+    return operator new(size, alignment, nothrow);
 }
 
-//Reads in 24-bit bitmap file into "image[]" array of RGBTRIPLEs.
-void readImage(char *filename) {
+NOT_INLINED void operator delete(void *memory, align_val_t) noexcept {
     #ifdef __WIN32__
-        //Open the file
-        hfile = CreateFile(filename,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,NULL,NULL);
-        //Read the header
-        ReadFile(hfile,&bfh,sizeof(bfh),&written,NULL);
-        ReadFile(hfile,&bih,sizeof(bih),&written,NULL);
-        //Read image
-        int imagesize = bih.biWidth*bih.biHeight; //Determine the image size for memory allocation
-        image = new RGBTRIPLE[imagesize]; //Create a new blank image array
-        ReadFile(hfile,image,imagesize*sizeof(RGBTRIPLE),&written,NULL); //Reads it off the disk
-        CloseHandle(hfile);  //Close source file
+        _aligned_free(memory);
     #else
-        //Open the file
-        hfile = fopen(filename, "rb");
-        //Read the header
-        fread(&bfh, sizeof(bfh), 1, hfile);
-        fread(&bih, sizeof(bih), 1, hfile);
-        //Read image
-        int imagesize = bih.biWidth*bih.biHeight; //Determine the image size for memory allocation
-        image = new RGBTRIPLE[imagesize]; //Create a new blank image array
-        fread(image, sizeof(RGBTRIPLE), imagesize, hfile); //Reads it off the disk
-        fclose(hfile);  //Close source file
+        free(memory);
     #endif
 }
 
-//Generates and saves DCPU code from the "image[]" array.
-void saveFile(char *filename) {
+NOT_INLINED void operator delete(void *memory, size_t, align_val_t alignment) noexcept {
+    operator delete(memory, alignment);
+}
 
-    ofstream oFile;
-    oFile.open(filename); //Open file for writing (overwrites file)
+NOT_INLINED void operator delete(void *memory, align_val_t alignment, const nothrow_t &) noexcept {
+    operator delete(memory, alignment);
+}
 
+NOT_INLINED void operator delete[](void *memory, align_val_t alignment) noexcept {
+    operator delete(memory, alignment);
+}
 
-    if (imageMode == HIGH_RES_SMALL) {
-        oFile << generateDCPUSmall();
-    }
-    else {
-        oFile << generateDCPUFull();
-    }
+NOT_INLINED void operator delete[](void *memory, size_t, align_val_t alignment) noexcept {
+    operator delete(memory, alignment);
+}
 
-    oFile.close(); //Close the file
+NOT_INLINED void operator delete[](void *memory, align_val_t alignment, const nothrow_t &) noexcept {
+    operator delete(memory, alignment);
 }
+#endif
+
+int main (int argc, char **argv) {
 
-string generateDCPUFull() {
-    stringstream output;
-    int frameWidth = 0;
-    if (imageMode == LOW_RES_FULL) {
-        frameWidth = LOW_RES_FULL_W;
-    }
-    else if (imageMode == HIGH_RES_FULL) {
-        frameWidth = HIGH_RES_FULL_W;
-    }
-
-    int frames = bih.biWidth / frameWidth;
-    generateColorPalette();
-    output << setupMonitor();
-
-    //Set up the DCPU custom font:
-    output << "SET B, font_space\n" <<
-              "SET A, 1\n" <<
-              "HWI [monitor]\n\n";
-
-    //Set up the DCPU custom color palette:
-    output << "SET B, palette_space\n" <<
-              "SET A, 2\n" <<
-              "HWI [monitor]\n\n";
-
-    output << "SET A, 0\n" <<
-              "SET B, tile_space\n" <<
-              "HWI [monitor]\n\n";
-
-    if (animationFlag == true) {
-        output << ":frame_loop\n" <<
-                  "IFE B, exit\n" <<
-                  "SET B, tile_space\n" <<
-                  "HWI [monitor]\n" <<
-                  "JSR delay\n" <<
-                  "ADD B, 0x0180\n" <<
-                  "SET PC, frame_loop\n\n" <<
-                  ":delay\n" <<
-                  "SET X, 0\n" <<
-                  ":loop\n" <<
-                  "ADD X, 1\n" <<
-                  "IFN X, 1000\n" <<
-                  "SET PC, loop\n" <<
-                  "SET PC, POP\n";
-    }
-
-    if (animationFlag == false) {
-        output << "BRK\n";
-    }
-
-    output << ":font_space DAT " << genFontSpace(imageMode) << "\n"; //Set up custom font
-    if (imageMode == LOW_RES_FULL) {
-        output << ":palette_space DAT " << genPaletteSpace();
-    }
-    else if (imageMode == HIGH_RES_FULL) {
-        output << ":palette_space DAT " << "0x0000, 0x0FFF";
-    }
-
-    output << "\n:tile_space DAT ";
-
-    for (int x=0;x<frames;++x) {
-        //Calculate the DCPU code for each "pixel" (tile)
-        //Skip every other row, because we take 2 at a time.
-        if (imageMode == LOW_RES_FULL) {
-            for (int i=0; i<bih.biHeight - 1; i+=2) {
-                for (int j=0; j<frameWidth; ++j) {
-                    int pxIndex = (32 * (i/2)) + j; //Index of the DCPU pixel (or tile);
-                    int imgIndex = (bih.biWidth * (bih.biHeight - (i+1) )) + j + (x * frameWidth); //Index of pixel in BMP
-                    output << generateLowResTile(pxIndex, image[imgIndex], image[imgIndex - bih.biWidth]);
+    vector<string> args; //Positional arguments
+    string batchDir;
+    bool batchMode = false;
+    bool benchMode = false;
+    bool watchMode = false;
+    unsigned int threadCount = 0; //0 means one worker per core, for the batch or for each conversion
+
+    for (int i=1; i<argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-help" || arg == "--help") {
+            args.clear();
+            break;
+        }
+        else if (arg == "--batch") {
+            if (i+1 >= argc) {
+                cout << "\nError: --batch requires an output directory.\n";
+                return 1;
+            }
+            batchDir = argv[++i];
+            batchMode = true;
+        }
+        else if (arg == "--threads") {
+            if (i+1 >= argc || atoll(argv[i+1]) <= 0) {
+                cout << "\nError: --threads requires a thread count of 1 or more.\n";
+                return 1;
+            }
+            threadCount = (unsigned int)min(atoll(argv[++i]), (long long)UINT32_MAX);
+        }
+        else if (arg == "--binary") {
+            string order = i+1 < argc ? argv[++i] : "";
+            if (order == "le") {
+                options.outputFormat = BINARY_LITTLE_ENDIAN;
+            }
+            else if (order == "be") {
+                options.outputFormat = BINARY_BIG_ENDIAN;
+            }
+            else {
+                cout << "\nError: --binary requires a byte order, 'le' or 'be'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--metric") {
+            string metric = i+1 < argc ? argv[++i] : "";
+            if (metric == "manhattan") {
+                options.colorMetric = MANHATTAN_METRIC;
+            }
+            else if (metric == "euclidean") {
+                options.colorMetric = EUCLIDEAN_METRIC;
+            }
+            else if (metric == "perceptual") {
+                options.colorMetric = PERCEPTUAL_METRIC;
+            }
+            else {
+                cout << "\nError: --metric requires 'manhattan', 'euclidean' or 'perceptual'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--palette") {
+            string algorithm = i+1 < argc ? argv[++i] : "";
+            if (algorithm == "popular") {
+                options.paletteAlgorithm = POPULAR_PALETTE;
+            }
+            else if (algorithm == "mediancut") {
+                options.paletteAlgorithm = MEDIAN_CUT_PALETTE;
+            }
+            else if (algorithm == "kmeans") {
+                options.paletteAlgorithm = K_MEANS_PALETTE;
+            }
+            else {
+                cout << "\nError: --palette requires 'popular', 'mediancut' or 'kmeans'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--resize") {
+            string mode = i+1 < argc ? argv[++i] : "";
+            if (mode == "32x24") {
+                options.resampleMode = LOW_RES_FULL;
+            }
+            else if (mode == "64x48") {
+                options.resampleMode = HIGH_RES_FULL;
+            }
+            else if (mode == "64x64") {
+                options.resampleMode = HIGH_RES_SMALL;
+            }
+            else {
+                cout << "\nError: --resize requires a mode, '32x24', '64x48' or '64x64'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--frames") {
+            if (i+1 >= argc || atoll(argv[i+1]) <= 0) {
+                cout << "\nError: --frames requires a frame count.\n";
+                return 1;
+            }
+            options.sourceFrames = atoll(argv[++i]);
+        }
+        else if (arg == "--grid") {
+            string size = i+1 < argc ? argv[++i] : "";
+            if (sscanf(size.c_str(), "%dx%d", &options.sheetColumns, &options.sheetRows) != 2 ||
+                options.sheetColumns <= 0 || options.sheetRows <= 0) {
+                cout << "\nError: --grid requires the frames across and down, such as 4x3.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--vertical") {
+            options.sheetColumns = 1;
+            options.sheetRows = 0;
+        }
+        else if (arg == "--fit") {
+            string policy = i+1 < argc ? argv[++i] : "";
+            if (policy == "letterbox") {
+                options.fitPolicy = LETTERBOX_FIT;
+            }
+            else if (policy == "crop") {
+                options.fitPolicy = CROP_FIT;
+            }
+            else if (policy == "stretch") {
+                options.fitPolicy = STRETCH_FIT;
+            }
+            else {
+                cout << "\nError: --fit requires 'letterbox', 'crop' or 'stretch'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--filter") {
+            string filter = i+1 < argc ? argv[++i] : "";
+            if (filter == "box") {
+                options.resampleFilter = BOX_FILTER;
+            }
+            else if (filter == "lanczos") {
+                options.resampleFilter = LANCZOS_FILTER;
+            }
+            else {
+                cout << "\nError: --filter requires 'box' or 'lanczos'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--raw") {
+            string size = i+1 < argc ? argv[++i] : "";
+            if (sscanf(size.c_str(), "%dx%d", &rawWidth, &rawHeight) != 2 || rawWidth <= 0 || rawHeight <= 0) {
+                cout << "\nError: --raw requires a frame size, such as 320x240.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--palette-frames") {
+            string frames = i+1 < argc ? argv[++i] : "";
+            options.paletteFrames = frames == "all" ? 0 : atoll(frames.c_str());
+            if (frames != "all" && options.paletteFrames <= 0) {
+                cout << "\nError: --palette-frames requires a frame count or 'all'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--palette-scope") {
+            string scope = i+1 < argc ? argv[++i] : "";
+            if (scope == "global") {
+                globalPalette = true;
+            }
+            else if (scope == "animation") {
+                globalPalette = false;
+            }
+            else {
+                cout << "\nError: --palette-scope requires 'global' or 'animation'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--delta") {
+            options.deltaEncoding = true;
+        }
+        else if (arg == "--dedup") {
+            options.frameDedup = true;
+        }
+        else if (arg == "--glyphs") {
+            options.glyphDictionary = true;
+        }
+        else if (arg == "--codec") {
+            string codec = i+1 < argc ? argv[++i] : "";
+            options.packingCodec = -1;
+            for (int j=0; j<3; ++j) {
+                if (codec == codecNames[j]) {
+                    options.packingCodec = j;
+                }
+            }
+            if (options.packingCodec < 0) {
+                cout << "\nError: --codec requires 'none', 'rle' or 'lz'.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--codec-report") {
+            codecReport = true;
+        }
+        else if (arg == "--fps") {
+            options.framesPerSecond = i+1 < argc ? atof(argv[++i]) : 0;
+            if (options.framesPerSecond <= 0 || options.framesPerSecond > 60) {
+                cout << "\nError: --fps requires a frame rate above 0 and up to 60.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--hold") {
+            //A list of frame:milliseconds pairs
+            stringstream holds(i+1 < argc ? argv[++i] : "");
+            for (string hold; getline(holds, hold, ',');) {
+                size_t colon = hold.find(':');
+                if (colon == string::npos || atoi(hold.c_str() + colon + 1) <= 0) {
+                    cout << "\nError: --hold requires frame:milliseconds pairs, such as 0:500,7:250.\n";
+                    return 1;
                 }
+                options.frameHoldMs[atoll(hold.c_str())] = atoi(hold.c_str() + colon + 1);
             }
         }
-        else if (imageMode == HIGH_RES_FULL) {
-            for (int i=0; i<bih.biHeight - 3; i+=4) {
-                for (int j=0; j<frameWidth - 1; j+=2) {
-                    int pxIndex = (32 * (i/4)) + j/2; //Index of the DCPU pixel (or tile)
-                    int imgIndex = (bih.biWidth * (bih.biHeight - (i+1) )) + j + (x * frameWidth); //Index of pixel in BMP
-                    //Analyze tile:
-                    output << generateHighResFullTile(pxIndex, imgIndex);
+        else if (arg == "--bench") {
+            benchMode = true;
+        }
+        else if (arg == "--bench-frames") {
+            //A list of frame counts
+            stringstream counts(i+1 < argc ? argv[++i] : "");
+            benchFrameCounts.clear();
+            for (string count; getline(counts, count, ',');) {
+                if (atoll(count.c_str()) <= 0) {
+                    benchFrameCounts.clear();
+                    break;
                 }
+                benchFrameCounts.push_back(atoll(count.c_str()));
+            }
+            if (benchFrameCounts.empty()) {
+                cout << "\nError: --bench-frames requires a list of frame counts, such as 1,10,100.\n";
+                return 1;
+            }
+        }
+        else if (arg == "--bench-save" || arg == "--bench-compare") {
+            if (i+1 >= argc) {
+                cout << "\nError: " << arg << " requires a baseline file.\n";
+                return 1;
+            }
+            (arg == "--bench-save" ? benchSaveFile : benchCompareFile) = argv[++i];
+        }
+        else if (arg == "--stats" || arg.compare(0, 8, "--stats=") == 0) {
+            statsEnabled = true;
+            statsFile = arg.size() > 8 ? arg.substr(8) : "";
+        }
+        else if (arg == "--verify") {
+            verifyOutput = true;
+        }
+        else if (arg == "--cache") {
+            if (i+1 >= argc) {
+                cout << "\nError: --cache requires a directory.\n";
+                return 1;
+            }
+            options.cacheDir = argv[++i];
+        }
+        else if (arg == "--cache-size") {
+            if (i+1 >= argc || atoll(argv[i+1]) <= 0) {
+                cout << "\nError: --cache-size requires a size in MB.\n";
+                return 1;
+            }
+            options.cacheLimitBytes = (uint64_t)atoll(argv[++i]) << 20;
+        }
+        else if (arg == "--watch") {
+            watchMode = true;
+        }
+        else if (arg == "--max-words") {
+            if (i+1 >= argc || atoll(argv[i+1]) <= 0) {
+                cout << "\nError: --max-words requires a number of words.\n";
+                return 1;
             }
+            options.maxWords = (uint32_t)min(atoll(argv[++i]), (long long)UINT32_MAX);
+        }
+        else if (arg == "--full-precision") {
+            options.fullPrecision = true;
+        }
+        else {
+            args.push_back(arg);
         }
     }
-    output << "\n:exit dat 0\n" <<
-              ":monitor dat 0\n" <<
-              ":not_found SET PC, 0\n";
-    return output.str();
-}
-
-string setupMonitor() {
-    stringstream result;
-    result << "HWN Z\n" <<
-              ":get_monitor\n" <<
-              "IFE Z, 0\n" <<
-              "SET PC, not_found\n" <<
-              "SUB Z, 1\n" <<
-              "HWQ Z\n" <<
-              "IFN A, 0xF615\n" <<
-              "SET PC, get_monitor\n" <<
-              "SET [monitor], Z\n\n";
-    return result.str();
-}
-
-string generateDCPUSmall() {
-    stringstream output;
-    int frameWidth = HIGH_RES_SMALL_W;
-    int frames = bih.biWidth / frameWidth;
-    output << setupMonitor();
-
-    //Set up the DCPU custom font:
-    output << "SET B, tile_space\n" <<
-              "SET A, 0\n" <<
-              "HWI [monitor]\n\n";
 
-    //Set up the DCPU custom color palette:
-    output << "SET B, palette_space\n" <<
-              "SET A, 2\n" <<
-              "HWI [monitor]\n\n";
-
-    output << "SET A, 1\n" <<
-              "SET B, font_space\n" <<
-              "HWI [monitor]\n\n";
-
-    if (animationFlag == true) {
-        output << ":frame_loop\n" <<
-                  "IFE B, exit\n" <<
-                  "SET B, font_space\n" <<
-                  "HWI [monitor]\n" <<
-                  "JSR delay\n" <<
-                  "ADD B, 512\n" <<
-                  "SET PC, frame_loop\n\n" <<
-                  ":delay\n" <<
-                  "SET X, 0\n" <<
-                  ":loop\n" <<
-                  "ADD X, 1\n" <<
-                  "IFN X, 1000\n" <<
-                  "SET PC, loop\n" <<
-                  "SET PC, POP\n";
+    //Display the help message
+    if (args.empty() && !batchMode && !benchMode)
+    {
+        cout << "Converts a 24-bit bitmap image into DCPU code for 0x10c.\n\n";
+        cout << "img2dcpu [imagefilename] [outputfilename]\n";
+        cout << "img2dcpu --batch [outputdir] [inputs...]\n";
+        cout << "img2dcpu --bench [inputs...]\n\n";
+        cout << "imagefilename   The filename of the bitmap image that is to be converted, or of a\n";
+        cout << "                Y4M stream ('-' for stdin).\n";
+        cout << "outputfilename  The filename of the text file that will contain the DCPU code.\n";
+        cout << "--batch         Converts every input into [outputdir], one worker per core.\n";
+        cout << "                Inputs may be files, directories or wildcard patterns.\n";
+        cout << "--threads n     Uses n worker threads instead of one per core, converting n\n";
+        cout << "                images at a time in a batch, or n frames at a time otherwise.\n";
+        cout << "--binary le|be  Writes a DCPU memory image of little or big-endian words instead\n";
+        cout << "                of assembly, with a symbol map in [outputfilename].sym.\n";
+        cout << "--metric m      Matches colors to the palette by 'manhattan' (default),\n";
+        cout << "                'euclidean' or 'perceptual' (CIE76) distance.\n";
+        cout << "--full-precision  Matches each pixel's full 24-bit color to the palette\n";
+        cout << "                instead of its 12-bit value.\n";
+        cout << "--palette p     Builds the palette from the 16 most 'popular' colors (default),\n";
+        cout << "                by 'mediancut', or by median cut refined with 'kmeans'.\n";
+        cout << "--resize m      Resamples images of other sizes to frames of mode '32x24',\n";
+        cout << "                '64x48' or '64x64'.\n";
+        cout << "--frames n      Cuts the image into n frames, left to right, with --resize,\n";
+        cout << "                or takes the first n frames of a --grid or --vertical sheet.\n";
+        cout << "--grid CxR      Reads the frames from a sprite sheet of C by R frames, left to\n";
+        cout << "                right and then top to bottom.\n";
+        cout << "--vertical      Reads the frames from a strip going down instead of across.\n";
+        cout << "--fit f         Fits resampled frames by 'letterbox' (default), 'crop' or\n";
+        cout << "                'stretch'.\n";
+        cout << "--filter f      Resamples with a 'box' (default) or 'lanczos' filter.\n";
+        cout << "--raw WxH       Reads the input as a stream of raw 24-bit RGB frames of WxH.\n";
+        cout << "--palette-frames n  Chooses a stream's palette from its first n frames (256 by\n";
+        cout << "                default), or from 'all' of them, reading a file twice.\n";
+        cout << "--palette-scope s  Gives each 'animation' its own palette (default), or shares\n";
+        cout << "                one 'global' palette between every image in a batch.\n";
+        cout << "--delta         Stores animations as a keyframe plus the changes from each\n";
+        cout << "                frame to the next, patched into one screen buffer.\n";
+        cout << "--dedup         Stores each distinct animation frame once, played through a\n";
+        cout << "                table of frames.\n";
+        cout << "--glyphs        Shares one glyph dictionary between the frames of a 64x64\n";
+        cout << "                animation, storing each frame as screen cells.\n";
+        cout << "--codec c       Packs the frames with 'rle' or 'lz' and adds the routine that\n";
+        cout << "                unpacks them on the DCPU ('none' is the default).\n";
+        cout << "--codec-report  Lists the packed size and unpacking cost of every codec.\n";
+        cout << "--fps n         Times animations with the generic clock at n frames per second.\n";
+        cout << "--hold f:ms,... Holds single frames for a given time with --fps (frames from 0).\n";
+        cout << "--max-words n   Fits the program into n words (65536 for all of the DCPU's memory)\n";
+        cout << "                by choosing the layout, and by dropping frames if none fits.\n";
+        cout << "--stats[=file]  Reports stage times, memory, allocations, region sizes and colors\n";
+        cout << "                as JSON, after the log or in [file].\n";
+        cout << "--verify        Runs the program on a built-in DCPU and LEM1802, checks every frame\n";
+        cout << "                against the image and reports its cycles, memory and HWIs.\n";
+        cout << "--watch         Keeps running, and converts the image again whenever it's saved,\n";
+        cout << "                rewriting only the frames that changed.\n";
+        cout << "--cache dir     Keeps converted frames in [dir] between runs, and only converts\n";
+        cout << "                frames it doesn't already hold.\n";
+        cout << "--cache-size n  Trims the cache back when it passes n MB (256 by default).\n";
+        cout << "--bench         Times each conversion stage on synthetic images of every mode,\n";
+        cout << "                then converts [inputs...] from end to end.\n";
+        cout << "--bench-frames n,...  Frame counts of the synthetic images (1 to 100000).\n";
+        cout << "--bench-save f  Saves the benchmark results as a baseline.\n";
+        cout << "--bench-compare f  Flags every result over 25% slower than a saved baseline.\n\n";
+        cout << "In order to generate an animation, you must input an image contains all frames,\n";
+        cout << "in order, from left to right. Each frame must have a resolution supported by\n";
+        cout << "img2dcpu. See the /examples folder for some sample images.\n\n";
+        cout << "Note: img2dcpu works with 32x24 color, 64x48 or 64x64 b&w images, and resamples\n";
+        cout << "other sizes to them with --resize.\n";
+        return 0;
     }
 
-    if (animationFlag == false) {
-        output << "BRK\n";
+    if (options.deltaEncoding + options.frameDedup + options.glyphDictionary + (options.packingCodec != NO_CODEC) > 1) {
+        cout << "\nError: Only one of --delta, --dedup, --glyphs and --codec can be used at a time.\n";
+        return 1;
     }
 
-    output << ":palette_space DAT " << "0x0000, 0x0FFF";
+    if (!options.frameHoldMs.empty() && options.framesPerSecond <= 0) {
+        cout << "\nError: --hold requires --fps.\n";
+        return 1;
+    }
 
-    output << "\n:tile_space DAT ";
-    output << genFontSpace(imageMode); //Set up custom font
+    options.workerThreads = threadCount;
 
-    output << "\n:font_space DAT ";
+    if (benchMode) {
+        return runBenchmark(args);
+    }
 
-    for (int x=0;x<frames;++x) {
-        for (int i=0; i<bih.biHeight - 7; i+=8) {
-            for (int j=0; j<frameWidth - 3; j+=4) {
-                int pxIndex = 2 * ((16 * (i/8)) + j/4); //Index of the DCPU pixel (or tile)
-                int imgIndex = (bih.biWidth * (bih.biHeight - (i+1) )) + j + (x * frameWidth); //Index of pixel in BMP
-                //Analyze tile:
-                output << generateHighResSmallTile(pxIndex, imgIndex);
-            }
+    if (batchMode) {
+        statsBatch = true;
+        int result = runBatch(batchDir, args, threadCount);
+        if (statsEnabled && !writeStats(true)) {
+            result = result == 0 ? 1 : result;
         }
+        return result;
     }
 
-    output << "\n:exit dat 0\n" <<
-              ":monitor dat 0\n" <<
-              ":not_found SET PC, 0\n";
-    return output.str();
-}
+    //Checks to see if only one image and one output file are supplied:
+    if (args.size() > 2) {
+        cout << "Too many arguments. Please run 'img2dcpu -help' for list of applicable arguments.";
+        return -1;
+    }
 
-//Converts and integer to a HEX string of a certain width.
-string int2hex(int i, int width) {
-  stringstream stream;
-  stream << hex << setfill('0') << setw(width) << i;
-  return stream.str();
-}
+    if (args.size() == 2 && watchMode) {
+        if (isStreamInput(args[0])) {
+            cout << "\nError: --watch can't be used with a stream.\n";
+            return 1;
+        }
+        if (options.maxWords > 0) {
+            cout << "\nError: --watch rewrites frames in place, so it can't be used with --max-words.\n";
+            return 1;
+        }
+        return runWatch(args[0], args[1]);
+    }
 
-//Rounds off colors to the nearest possible value for the current DCPU palette
-int roundColorToPalette(RGBTRIPLE color) {
-    int minRGBdiff = 60000; //Set a high enough minimum to guarantee it will be overwritten
-    int closestColor = 0; //Closest palette color to the actual color
-    for (int i=0; i<16; ++i) {
-        int RGBdiff = abs(color.rgbtRed - (currentPalette[i][0] << 4));
-        RGBdiff += abs(color.rgbtGreen - (currentPalette[i][1] << 4));
-        RGBdiff += abs(color.rgbtBlue - (currentPalette[i][2] << 4));
-        //Select the color with the smallest deviation:
-        if (RGBdiff < minRGBdiff) {
-            minRGBdiff = RGBdiff;
-            closestColor = i;
+    if (args.size() == 2) { // All arguments are included
+        int result = convertFile(args[0], args[1], cout);
+        if (statsEnabled && result == 0 && !writeStats(false)) {
+            result = 1;
         }
+        return result;
     }
 
-    return closestColor;
-}
+    else { // If only one argument is included, error
+        cout << "\nEither image or save file was not specified; file will not be saved.\n";
+        return 1;
+    }
 
-int roundColorValue(RGBTRIPLE color) {
-
-    //Convert 8-bit color values to 4-bit:
-    int closestR = (color.rgbtRed + 8) / 16;
-    if (closestR == 16)
-        closestR = 15;
-    int closestG = (color.rgbtGreen + 8) / 16;
-    if (closestG == 16)
-        closestG = 15;
-    int closestB = (color.rgbtBlue + 8) / 16;
-    if (closestB == 16)
-        closestB = 15;
-
-    //Concatenate RGB values:
-    return closestR * 256 + closestG * 16 + closestB;
+    return 0; //exit
 }
 
-//Creates a color palette that closely matches the image.
-void generateColorPalette() {
-    int imageSize = bih.biWidth * bih.biHeight;
-    unsigned int colorCounts[4096] = {};
-    unsigned int tempCounts[16] = {};
-    unsigned int tempPalette[16] = {};
-
-    //Find color frequencies:
-    for (int i=0; i<imageSize; ++i) {
-        ++colorCounts[roundColorValue(image[i])];
-    }
-    //Find 16 most common colors:
-    for (int i=0; i<4096; ++i) {
-        for (int j=0; j<16; ++j) {
-            if (colorCounts[i] > tempCounts[j]) {
-                for (int k=15; k>j; --k) {
-                    tempPalette[k] = tempPalette[k-1];
-                    tempCounts[k] = tempCounts[k-1];
-                }
-                tempPalette[j] = i;
-                tempCounts[j] = colorCounts[i];
-                break;
+//Converts a single bitmap into a DCPU file, writing progress to "log". Returns 0 on success.
+int convertFile(const string &imageFilename, const string &outputFilename, ostream &log) {
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    uint64_t allocations = allocationCount, bytes = allocatedBytes;
+    Converter converter(options);
+    FILE *input = NULL; //The file a stream is read from
+    if (isStreamInput(imageFilename)) {
+        //A stream is converted as it's read, so nothing can look at all of its frames afterwards:
+        if (verifyOutput || statsEnabled || codecReport || options.maxWords > 0) {
+            log << "\nError: --verify, --stats, --codec-report and --max-words can't be used with a stream.\n";
+            return 1;
+        }
+        log << "Opening stream...";
+        if (imageFilename == "-") {
+            #ifdef __WIN32__
+                _setmode(_fileno(stdin), _O_BINARY);
+            #endif
+            input = stdin;
+        }
+        else {
+            input = fopen(imageFilename.c_str(), "rb");
+        }
+        if (input == NULL || !converter.openStream(input, rawWidth, rawHeight)) {
+            log << "\nError: Could not read a " << (rawWidth > 0 ? "raw RGB" : "Y4M") << " stream from '"
+                << imageFilename << "'.\n";
+            if (input != NULL && input != stdin) {
+                fclose(input);
             }
-
+            return 3;
         }
+        log << " Done.\n\n";
+        log << " Frame Width : " << converter.bih.biWidth << "\n";
+        log << "Frame Height : " << converter.bih.biHeight << "\n";
     }
+    else {
+        log << "Loading image...";
+        if (!converter.readImage(imageFilename.c_str())) { //Read in the bitmap image
+            log << "\nError: Could not read a 24-bit bitmap from '" << imageFilename << "'.\n";
+            return 3;
+        }
+        log << " Done.\n\n";
+        log << " Image Width : " << converter.bih.biWidth << "\n";  //Will output the width of the bitmap
+        log << "Image Height : " << converter.bih.biHeight << "\n"; //Will output the height of the bitmap
+    }
+    double readTime = secondsSince(start);
 
-    //Generate current palette format:
-    for (int i=0; i<16; ++i) {
-        currentPalette[i][0] = (tempPalette[i] & 0b111100000000) >> 8;
-        currentPalette[i][1] = (tempPalette[i] & 0b000011110000) >> 4;
-        currentPalette[i][2] = (tempPalette[i] & 0b000000001111);
+    int result = converter.selectImageMode(log);
+    if (result == 0 && options.maxWords > 0) {
+        result = converter.planProgram(log);
     }
-}
 
-//Generates the DCPU for the custom font space, depending on the font width required
-string genFontSpace(int imageMode) {
-    stringstream stream;
-
-    //Set up custom low res font space:
-    if (imageMode == LOW_RES_FULL) {
-        stream << "0x0f0f, 0x0f0f\n";
-    }
-
-    //Set up custom full high res font space:
-    else if (imageMode == HIGH_RES_FULL) {
-        int decValues[4] = {0, 3, 12, 15};
-        for (int i=0; i<4; ++i) {
-            for (int j=0; j<4; ++j) {
-                for (int k=0; k<4; ++k) {
-                    for (int l=0; l<2; ++l) {
-                        string ij = int2hex(decValues[i], 1) + int2hex(decValues[j], 1);
-                        string kl = int2hex(decValues[k], 1) + int2hex(decValues[l], 1);
-                        stream << "0x" + ij + ij + ", ";
-                        stream << "0x" + kl + kl + ", ";
-                    }
-                }
-            }
-        }
+    if (result == 0 && codecReport) {
+        converter.reportCodecs(converter.bih.biWidth / converter.frameWidth(), log);
     }
 
-    //Sets up custom highres "letter space":
-    else if (imageMode == HIGH_RES_SMALL) {
-        for (int i=0; i<64; ++i) {
-            stream << "0x0000, ";
-        }
-        for (int i=0; i<8; ++i) {
-            for (int j=0; j<8; ++j) {
-                stream << "0x0000, ";
+    if (result == 0) {
+        log << "\nGenerating DCPU file...";
+        chrono::steady_clock::time_point saveStart = chrono::steady_clock::now();
+        converter.paletteSeconds = converter.tileSeconds = converter.writeSeconds = 0;
+        if (converter.saveFile(outputFilename.c_str())) {
+            log << " Done.\n";
+            if (options.outputFormat == TEXT_OUTPUT && options.maxWords == 0 && converter.wordAddress > 0x10000) {
+                log << "\nWarning: The program holds " << converter.wordAddress << " words of data, more than the "
+                    << "DCPU's 65536; --max-words 65536 chooses a layout that fits.\n";
+            }
+            if (statsEnabled) {
+                string report = converter.statsReport(imageFilename, outputFilename, readTime,
+                                                      secondsSince(saveStart), secondsSince(start),
+                                                      statsBatch ? -1 : (int64_t)(allocationCount - allocations),
+                                                      statsBatch ? -1 : (int64_t)(allocatedBytes - bytes),
+                                                      peakMemoryBytes());
+                lock_guard<mutex> lock(statsMutex);
+                statsReports.push_back(report);
             }
-            for (int j=0; j<16; ++j) {
-                int charIndex = i*16 + j;
-                stream << "0x01" + int2hex(charIndex, 2) + ", ";
+            if (!options.cacheDir.empty()) {
+                log << "  Frame Cache : " << converter.flushedHits << " hits, " << converter.flushedMisses
+                    << " misses\n";
             }
-            for (int j=0; j<8; ++j) {
-                stream << "0x0000, ";
+            if (input != NULL) {
+                log << "      Frames : " << converter.streamFrames << "\n";
+            }
+            if (converter.animationFlag && converter.options.frameDedup) {
+                log << "Unique Frames : " << converter.uniqueFrames << " of "
+                    << converter.bih.biWidth / converter.frameWidth() << "\n";
+            }
+            if (converter.animationFlag && converter.options.glyphDictionary &&
+                converter.imageMode == HIGH_RES_SMALL) {
+                log << "  Glyph Fonts : " << converter.fontCount << "\n";
+            }
+            if (verifyOutput) {
+                result = converter.verifyProgram(log);
             }
         }
-        for (int i=0; i<64; ++i) {
-            stream << "0x0000, ";
+        else if (!converter.assemblerError.empty()) {
+            log << "\nError: " << converter.assemblerError << "\n";
+            result = 4;
+        }
+        else {
+            log << "\nError: Could not write to '" << outputFilename << "'.\n";
+            result = 4;
         }
     }
 
-  return stream.str();
+    if (input != NULL && input != stdin) {
+        fclose(input);
+    }
+    return result;
 }
 
-string genPaletteSpace() {
-    stringstream result;
-    for (int i=0; i<16; ++i) {
-        int r, g, b;
-        r = currentPalette[i][0];
-        g = currentPalette[i][1];
-        b = currentPalette[i][2];
-        result << "0x0" << int2hex(r,1) << int2hex(g,1) << int2hex(b,1) << ", ";
+//The error that ended a conversion with "result", from its "log": everything from its last error message on, or
+//its last line if it didn't give one.
+string conversionError(const string &log, int result) {
+    size_t error = log.rfind("\nError");
+    if (error != string::npos) {
+        return log.substr(error);
+    }
+    size_t end = log.find_last_not_of("\n");
+    if (end == string::npos) {
+        stringstream message;
+        message << "\nError: The conversion failed with code " << result << ".\n";
+        return message.str();
     }
-    return result.str();
+    size_t start = log.find_last_of('\n', end);
+    start = start == string::npos ? 0 : start + 1;
+    return "\n" + log.substr(start, end + 1 - start) + "\n";
 }
 
-//Generates DCPU code for two vertically adjacent BMP pixels (one DCMP tile).
-string generateLowResTile(int index, RGBTRIPLE firstPixel, RGBTRIPLE secondPixel) {
-    string output;
-
-    //Find the closest allowable hex value for each color:
-    int fRGB = roundColorToPalette(firstPixel);
-    int sRGB = roundColorToPalette(secondPixel);
+//Whether "filename" is read as a stream of frames rather than as a bitmap: stdin ("-"), a .y4m file, or
+//anything with --raw.
+bool isStreamInput(const string &filename) {
+    string extension = filename.size() > 4 ? filename.substr(filename.size() - 4) : "";
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return filename == "-" || extension == ".y4m" || rawWidth > 0;
+}
 
-    output = "0x" + int2hex(fRGB, 1) + int2hex(sRGB, 1) + "00, ";
+//Converts an image, then converts it again each time it's saved, until the process is stopped. Changes are
+//noticed through inotify on Linux, and by checking the file's size and time every 100 ms elsewhere. Returns
+//only if the image can't be converted the first time.
+int runWatch(const string &imageFilename, const string &outputFilename) {
+    Converter converter(options);
+    bool patched;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (converter.updateFile(imageFilename.c_str(), outputFilename.c_str(), patched) < 0) {
+        cout << "\nError: Could not convert '" << imageFilename << "' into '" << outputFilename << "'.\n";
+        return 3;
+    }
+    cout << "Converted " << converter.bih.biWidth / converter.frameWidth() << " frames into " << outputFilename << " in "
+         << fixed << setprecision(1) << secondsSince(start) * 1000 << " ms.\n";
+    cout << "Watching '" << imageFilename << "' for changes. Press Ctrl+C to stop.\n" << flush;
+
+    #ifdef __linux__
+        //Editors often save to a new file and rename it over the old one, so the directory is watched:
+        size_t slash = imageFilename.find_last_of('/');
+        string directory = slash == string::npos ? "." : imageFilename.substr(0, slash + 1);
+        string name = imageFilename.substr(slash == string::npos ? 0 : slash + 1);
+        int notify = inotify_init();
+        int watch = notify >= 0 ? inotify_add_watch(notify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+    #endif
+    struct stat info;
+    time_t lastTime = stat(imageFilename.c_str(), &info) == 0 ? info.st_mtime : 0;
+    off_t lastSize = stat(imageFilename.c_str(), &info) == 0 ? info.st_size : 0;
+
+    for (;;) {
+        #ifdef __linux__
+        if (watch >= 0) {
+            bool saved = false;
+            while (!saved) {
+                char events[4096];
+                ssize_t length = read(notify, events, sizeof(events));
+                if (length <= 0) {
+                    cout << "\nError: Stopped watching '" << imageFilename << "'.\n";
+                    return 1;
+                }
+                for (ssize_t i=0; i<length; ) {
+                    const inotify_event *event = (const inotify_event *)(events + i);
+                    if (event->len > 0 && name == event->name) {
+                        saved = true;
+                    }
+                    i += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+        else
+        #endif
+        {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            if (stat(imageFilename.c_str(), &info) != 0 || (info.st_mtime == lastTime && info.st_size == lastSize)) {
+                continue;
+            }
+            lastTime = info.st_mtime;
+            lastSize = info.st_size;
+        }
 
-    return output;
+        start = chrono::steady_clock::now();
+        int64_t converted = converter.updateFile(imageFilename.c_str(), outputFilename.c_str(), patched);
+        if (converted < 0) {
+            cout << "Could not convert '" << imageFilename << "'; waiting for the next save.\n" << flush;
+            continue;
+        }
+        cout << "Converted " << converted << " of " << converter.bih.biWidth / converter.frameWidth()
+             << " frames and " << (patched ? "rewrote them in place" : "saved the program again") << " in "
+             << fixed << setprecision(1) << secondsSince(start) * 1000 << " ms.\n" << flush;
+    }
 }
 
-//Generates the High Res Full Size tile when using the higher resolution 7-bit font width
-string generateHighResFullTile(int pxIndex, int imgIndex) {
-    boolean invertFlag;
-    string output;
-    int i, j, k, l;
+//Converts every input on a pool of worker threads. Per-file errors are reported but do not stop the batch.
+int runBatch(const string &outputDir, const vector<string> &inputs, unsigned int threadCount) {
+    vector<string> files;
+    for (size_t i=0; i<inputs.size(); ++i) {
+        expandInputs(inputs[i], files);
+    }
+    //The same image may be matched by more than one input:
+    sort(files.begin(), files.end());
+    files.erase(unique(files.begin(), files.end()), files.end());
+    if (files.empty()) {
+        cout << "\nError: No bitmap images were found to convert.\n";
+        return 1;
+    }
 
-    if (roundColorValue(image[(imgIndex+1) - bih.biWidth]) == 0) {
-        invertFlag = false;
+    #ifdef __WIN32__
+        CreateDirectory(outputDir.c_str(), NULL);
+    #else
+        mkdir(outputDir.c_str(), 0777);
+    #endif
 
-        if (roundColorValue(image[imgIndex+1]) == 0) {
-            l = 0;
-        }
-        else {
-            l = 1;
+    if (threadCount == 0) {
+        threadCount = defaultThreadCount();
+    }
+    if (threadCount > files.size()) {
+        threadCount = files.size();
+    }
+    //Each conversion splits its frames between the cores that the batch workers leave free:
+    options.workerThreads = max(1u, defaultThreadCount() / threadCount);
+
+    //A global palette is chosen from the colors of every full color image before any are converted. Without
+    //any, each image keeps its own palette:
+    if (globalPalette) {
+        uint64_t colorCounts[4096] = {};
+        bool counted = false;
+        mutex countMutex;
+        runOnPool(files.size(), threadCount, [&](size_t job) {
+            stringstream log;
+            Converter converter(options);
+            if (converter.readImage(files[job].c_str())) {
+                if (converter.selectImageMode(log) == 0 && converter.imageMode == LOW_RES_FULL) {
+                    uint64_t imageCounts[4096] = {};
+                    converter.countColors(imageCounts);
+                    lock_guard<mutex> lock(countMutex);
+                    for (int i=0; i<4096; ++i) {
+                        colorCounts[i] += imageCounts[i];
+                        counted = counted || imageCounts[i] > 0;
+                    }
+                }
+            }
+        });
+        if (counted) {
+            Converter paletteConverter(options);
+            paletteConverter.choosePalette(colorCounts, options.sharedPalette);
+            options.sharedPaletteReady = true;
         }
+    }
 
-        if (roundColorValue(image[(imgIndex+1) - 2* bih.biWidth]) == 0) {
-            if (roundColorValue(image[(imgIndex+1) - 3* bih.biWidth]) == 0) {
-                k = 0;
-            }
-            else {
-                k = 2;
-            }
+    atomic<int> firstError(0);
+    atomic<size_t> failed(0);
+    mutex logMutex;
+
+    //Each output file keeps its image's base name, with a .txt or .bin extension. Images with the same base
+    //name from different directories would overwrite each other's output, so none of them are converted:
+    vector<string> outputFilenames(files.size()), names(files.size());
+    map<string, int> nameCounts;
+    for (size_t i=0; i<files.size(); ++i) {
+        string name = files[i];
+        size_t slash = name.find_last_of("/\\");
+        if (slash != string::npos) {
+            name = name.substr(slash + 1);
         }
-        else {
-            if (roundColorValue(image[(imgIndex+1) - 3* bih.biWidth]) == 0) {
-                k = 1;
-            }
-            else {
-                k = 3;
-            }
+        size_t dot = name.find_last_of('.');
+        if (dot != string::npos) {
+            name = name.substr(0, dot);
         }
+        outputFilenames[i] = outputDir + "/" + name + (options.outputFormat == TEXT_OUTPUT ? ".txt" : ".bin");
+        #ifdef __WIN32__
+            transform(name.begin(), name.end(), name.begin(), ::tolower); //File names ignore case
+        #endif
+        names[i] = name;
+        ++nameCounts[name];
+    }
+    vector<BYTE> sharedName(files.size());
+    for (size_t i=0; i<files.size(); ++i) {
+        sharedName[i] = nameCounts[names[i]] > 1;
+    }
 
-        if (roundColorValue(image[imgIndex]) == 0) {
-            if (roundColorValue(image[imgIndex - bih.biWidth]) == 0) {
-                j = 0;
-            }
-            else {
-                j = 2;
-            }
+    runOnPool(files.size(), threadCount, [&](size_t job) {
+        const string &outputFilename = outputFilenames[job];
+        stringstream log;
+        int result = 1;
+        if (sharedName[job]) {
+            log << "\nError: Another image in the batch would also be saved as '" << outputFilename << "'.\n";
         }
         else {
-            if (roundColorValue(image[imgIndex - bih.biWidth]) == 0) {
-                j = 1;
-            }
-            else {
-                j = 3;
-            }
+            result = convertFile(files[job], outputFilename, log);
         }
 
-        if (roundColorValue(image[imgIndex - 2* bih.biWidth]) == 0) {
-            if (roundColorValue(image[imgIndex - 3* bih.biWidth]) == 0) {
-                i = 0;
-            }
-            else {
-                i = 2;
-            }
+        lock_guard<mutex> lock(logMutex);
+        if (result == 0) {
+            cout << files[job] << " -> " << outputFilename << "\n";
         }
         else {
-            if (roundColorValue(image[imgIndex - 3* bih.biWidth]) == 0) {
-                i = 1;
-            }
-            else {
-                i = 3;
-            }
+            int expected = 0;
+            firstError.compare_exchange_strong(expected, result);
+            ++failed;
+            cout << files[job] << " failed:" << conversionError(log.str(), result) << "\n";
         }
-    }
-    else {
-        invertFlag = true;
+    });
 
-        if (roundColorValue(image[imgIndex+1]) == 0) {
-            l = 1;
+    cout << "\nConverted " << (files.size() - failed) << " of " << files.size() << " images using "
+         << threadCount << " threads.\n";
+    return firstError;
+}
+
+//Adds the bitmap files named by "input" (a file, a directory or a wildcard pattern) to "files".
+void expandInputs(const string &input, vector<string> &files) {
+    vector<string> found;
+    #ifdef __WIN32__
+        string pattern = input;
+        string dir;
+        DWORD attributes = GetFileAttributes(input.c_str());
+        if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            dir = input + "\\";
+            pattern = dir + "*.bmp";
         }
         else {
-            l = 0;
-        }
-
-        if (roundColorValue(image[(imgIndex+1) - 2* bih.biWidth]) == 0) {
-            if (roundColorValue(image[(imgIndex+1) - 3* bih.biWidth]) == 0) {
-                k = 3;
+            size_t slash = input.find_last_of("/\\");
+            if (slash != string::npos) {
+                dir = input.substr(0, slash + 1);
             }
-            else {
-                k = 1;
+        }
+        WIN32_FIND_DATA findData;
+        HANDLE findHandle = FindFirstFile(pattern.c_str(), &findData);
+        if (findHandle != INVALID_HANDLE_VALUE) {
+            do {
+                if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                    found.push_back(dir + findData.cFileName);
+                }
+            } while (FindNextFile(findHandle, &findData));
+            FindClose(findHandle);
+        }
+    #else
+        struct stat info;
+        if (stat(input.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+            DIR *dir = opendir(input.c_str());
+            if (dir != NULL) {
+                for (dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+                    string name = entry->d_name;
+                    if (name.size() > 4) {
+                        string extension = name.substr(name.size() - 4);
+                        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+                        if (extension == ".bmp") {
+                            found.push_back(input + "/" + name);
+                        }
+                    }
+                }
+                closedir(dir);
             }
         }
         else {
-            if (roundColorValue(image[(imgIndex+1) - 3* bih.biWidth]) == 0) {
-                k = 2;
-            }
-            else {
-                k = 0;
+            glob_t matches;
+            if (glob(input.c_str(), 0, NULL, &matches) == 0) {
+                for (size_t i=0; i<matches.gl_pathc; ++i) {
+                    found.push_back(matches.gl_pathv[i]);
+                }
             }
+            globfree(&matches);
         }
+    #endif
 
-        if (roundColorValue(image[imgIndex]) == 0) {
-            if (roundColorValue(image[imgIndex - bih.biWidth]) == 0) {
-                j = 3;
-            }
-            else {
-                j = 1;
+    //A name that matched nothing is kept so that its error gets reported:
+    if (found.empty()) {
+        found.push_back(input);
+    }
+    files.insert(files.end(), found.begin(), found.end());
+}
+
+//Times the conversion stages on synthetic images of every mode, then converts each of "inputs" from end to
+//end. Results can be saved as a baseline and compared with one, flagging any stage that got slower.
+int runBenchmark(const vector<string> &inputs) {
+    const int modeSizes[3][2] = {{LOW_RES_FULL_W, LOW_RES_FULL_H}, {HIGH_RES_FULL_W, HIGH_RES_FULL_H},
+                                 {HIGH_RES_SMALL_W, HIGH_RES_SMALL_H}};
+    const char *stageNames[5] = {"read", "palette", "tiles", "emit", "write"};
+    #ifdef __WIN32__
+        const char *tempVariable = getenv("TEMP");
+        string tempDir = tempVariable != NULL ? tempVariable : ".";
+    #else
+        const char *tempVariable = getenv("TMPDIR");
+        string tempDir = tempVariable != NULL ? tempVariable : "/tmp";
+    #endif
+    string imageFilename = tempDir + "/img2dcpu_bench.bmp";
+    string outputFilename = tempDir + "/img2dcpu_bench.out";
+    vector<pair<string, double> > results; //"case stage" -> seconds per frame
+
+    cout << "Stage throughput in frames per second, and MB per second of bitmap read and program written:\n\n";
+    cout << "Case               Read   Palette     Tiles      Emit     Write  Read MB/s  Write MB/s\n";
+    for (int mode=0; mode<3; ++mode) {
+        for (size_t f=0; f<benchFrameCounts.size(); ++f) {
+            int64_t frames = benchFrameCounts[f];
+            if (!writeSyntheticBitmap(imageFilename, modeSizes[mode][0], modeSizes[mode][1], frames)) {
+                cout << "\nError: Could not write '" << imageFilename << "'.\n";
+                return 1;
             }
-        }
-        else {
-            if (roundColorValue(image[imgIndex - bih.biWidth]) == 0) {
-                j = 2;
+
+            //Each case runs at least three times and for a quarter of a second, keeping each stage's best time:
+            double stages[5];
+            fill(stages, stages + 5, 1e30);
+            int64_t imageBytes = 0, outputBytes = 0;
+            chrono::steady_clock::time_point caseStart = chrono::steady_clock::now();
+            for (int run=0; run < 3 || secondsSince(caseStart) < 0.25; ++run) {
+                stringstream log;
+                Converter converter(options);
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                if (!converter.readImage(imageFilename.c_str()) || converter.selectImageMode(log) != 0) {
+                    cout << "\nError: Could not read '" << imageFilename << "'.\n";
+                    return 1;
+                }
+                //Page in the whole file, which is otherwise only read as the tiles are generated:
+                int touched = 0;
+                for (int64_t i=0; i<converter.mappingSize; i+=4096) {
+                    touched += converter.mapping[i];
+                }
+                benchSink = touched;
+                imageBytes = converter.mappingSize;
+                stages[0] = min(stages[0], secondsSince(start));
+
+                //Emitting is whatever saveFile spends outside the palette, tiles and writes:
+                start = chrono::steady_clock::now();
+                if (!converter.saveFile(outputFilename.c_str())) {
+                    cout << "\nError: Could not write '" << outputFilename << "'.\n";
+                    return 1;
+                }
+                double total = secondsSince(start);
+                stages[1] = min(stages[1], converter.paletteSeconds);
+                stages[2] = min(stages[2], converter.tileSeconds);
+                stages[3] = min(stages[3], total - converter.paletteSeconds - converter.tileSeconds
+                                           - converter.writeSeconds);
+                stages[4] = min(stages[4], converter.writeSeconds);
+                converter.closeImage();
+
+                outputBytes = ifstream(outputFilename.c_str(), ios::binary | ios::ate).tellg();
             }
-            else {
-                j = 0;
+            remove(imageFilename.c_str());
+            remove(outputFilename.c_str());
+
+            stringstream name;
+            name << modeSizes[mode][0] << "x" << modeSizes[mode][1] << "x" << frames;
+            cout << left << setw(14) << name.str() << right;
+            for (int i=0; i<5; ++i) {
+                if (i == 1 && mode == HIGH_RES_SMALL) {
+                    cout << setw(10) << "-"; //Centered images use a fixed palette
+                }
+                else {
+                    results.push_back(make_pair(name.str() + " " + stageNames[i], stages[i] / frames));
+                    cout << setw(10) << (int64_t)(frames / max(stages[i], 1e-9));
+                }
             }
+            cout << fixed << setprecision(1) << setw(11) << imageBytes / max(stages[0], 1e-9) / 1e6
+                 << setw(12) << outputBytes / max(stages[4], 1e-9) / 1e6 << "\n";
         }
+    }
 
-        if (roundColorValue(image[imgIndex - 2* bih.biWidth]) == 0) {
-            if (roundColorValue(image[imgIndex - 3* bih.biWidth]) == 0) {
-                i = 3;
+    //End to end conversions, as from the command line:
+    vector<string> files;
+    for (size_t i=0; i<inputs.size(); ++i) {
+        expandInputs(inputs[i], files);
+    }
+    sort(files.begin(), files.end());
+    files.erase(unique(files.begin(), files.end()), files.end());
+    if (!files.empty()) {
+        cout << "\nEnd to end, in milliseconds per conversion:\n\n";
+    }
+    for (size_t i=0; i<files.size(); ++i) {
+        const int RUNS = 20;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int run=0; run<RUNS; ++run) {
+            stringstream log;
+            int result = convertFile(files[i], outputFilename, log);
+            if (result != 0) {
+                cout << files[i] << " failed:" << conversionError(log.str(), result) << "\n";
+                break;
             }
-            else {
-                i = 1;
+        }
+        double seconds = secondsSince(start) / RUNS;
+        remove(outputFilename.c_str());
+        string name = files[i].substr(files[i].find_last_of("/\\") + 1);
+        results.push_back(make_pair(name + " total", seconds));
+        cout << left << setw(30) << name << right << fixed << setprecision(3) << setw(10) << seconds * 1000 << "\n";
+    }
+
+    int result = 0;
+    if (!benchCompareFile.empty()) {
+        //Baseline lines are "case stage seconds"; anything more than BENCH_TOLERANCE slower is a regression:
+        const double BENCH_TOLERANCE = 0.25;
+        ifstream baseline(benchCompareFile.c_str());
+        if (!baseline) {
+            cout << "\nError: Could not read the baseline '" << benchCompareFile << "'.\n";
+            return 1;
+        }
+        map<string, double> expected;
+        string benchCase, stage;
+        double seconds;
+        while (baseline >> benchCase >> stage >> seconds) {
+            expected[benchCase + " " + stage] = seconds;
+        }
+        int regressions = 0;
+        cout << "\nCompared with " << benchCompareFile << ":\n";
+        for (size_t i=0; i<results.size(); ++i) {
+            map<string, double>::iterator before = expected.find(results[i].first);
+            if (before != expected.end() && before->second > 0 && results[i].second > before->second * (1 + BENCH_TOLERANCE)) {
+                cout << "  Regression: " << results[i].first << " is " << setprecision(0)
+                     << (results[i].second / before->second - 1) * 100 << "% slower\n";
+                ++regressions;
             }
         }
+        if (regressions == 0) {
+            cout << "  No regressions.\n";
+        }
         else {
-            if (roundColorValue(image[imgIndex - 3* bih.biWidth]) == 0) {
-                i = 2;
-            }
-            else {
-                i = 0;
-            }
+            result = 6;
+        }
+    }
+    if (!benchSaveFile.empty()) {
+        ofstream baseline(benchSaveFile.c_str());
+        baseline << scientific << setprecision(6);
+        for (size_t i=0; i<results.size(); ++i) {
+            baseline << results[i].first << " " << results[i].second << "\n";
+        }
+        if (!baseline) {
+            cout << "\nError: Could not write the baseline '" << benchSaveFile << "'.\n";
+            return 1;
         }
+        cout << "\nSaved the baseline to " << benchSaveFile << ".\n";
     }
+    return result;
+}
 
-    //Convert IJKL character into font array index
-    int character =  32*i + 8*j + 2*k + l;
-    //Invert the tile is needed:
-    if (invertFlag == true) {
-        output = "0x01" + int2hex(character, 2) + ", ";
+//Writes a 24-bit bitmap of "frames" synthetic frames side by side, each "width" by "height". Full color
+//frames are shifting gradients with a little noise; the others are a moving disc over stripes, rounded to
+//black and white.
+bool writeSyntheticBitmap(const string &filename, int width, int height, int64_t frames) {
+    int64_t imageWidth = width * frames;
+    int64_t rowBytes = (imageWidth * 3 + 3) & ~3;
+    if (imageWidth > 0x7FFFFFFF) {
+        return false;
     }
-    else {
-        output = "0x10" + int2hex(character, 2) + ", ";
+    BITMAPFILEHEADER fileHeader = {};
+    BITMAPINFOHEADER infoHeader = {};
+    fileHeader.bfType = 0x4D42;
+    fileHeader.bfOffBits = sizeof(fileHeader) + sizeof(infoHeader);
+    fileHeader.bfSize = fileHeader.bfOffBits + rowBytes * height;
+    infoHeader.biSize = sizeof(infoHeader);
+    infoHeader.biWidth = imageWidth;
+    infoHeader.biHeight = height;
+    infoHeader.biPlanes = 1;
+    infoHeader.biBitCount = 24;
+    infoHeader.biSizeImage = rowBytes * height;
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (file == NULL) {
+        return false;
     }
-
-    return output;
+    fwrite(&fileHeader, sizeof(fileHeader), 1, file);
+    fwrite(&infoHeader, sizeof(infoHeader), 1, file);
+    vector<BYTE> row(rowBytes);
+    uint32_t noise = 12345;
+    for (int y=height - 1; y>=0; --y) { //Bottom-up
+        for (int64_t column=0; column<imageWidth; ++column) {
+            int64_t frame = column / width;
+            int x = column % width;
+            BYTE *out = &row[column * 3];
+            noise = noise * 1103515245 + 12345;
+            if (height == LOW_RES_FULL_H) {
+                out[2] = (x * 8 + frame * 5 + (noise >> 28)) & 0xFF;
+                out[1] = (y * 10 + frame * 3) & 0xFF;
+                out[0] = ((x ^ y) * 16 + frame) & 0xFF;
+            }
+            else {
+                int centerX = (frame * 3) % width;
+                int centerY = height / 2 + (frame % 16) - 8;
+                bool disc = (x - centerX) * (x - centerX) + (y - centerY) * (y - centerY) < height * height / 16;
+                bool stripe = ((x + frame) / 4 + y / 4) % 2 == 0;
+                out[0] = out[1] = out[2] = disc != stripe ? 0xFF : 0x00;
+            }
+        }
+        fwrite(&row[0], 1, rowBytes, file);
+    }
+    bool written = !ferror(file);
+    return fclose(file) == 0 && written;
 }
 
-//Generates the High Res Small Size tile when using the higher resolution 7-bit font width
-string generateHighResSmallTile(int pxIndex, int imgIndex) {
+//Peak resident memory of the whole process, in bytes.
+uint64_t peakMemoryBytes() {
+    uint64_t peakMemory = 0;
+    #ifdef __WIN32__
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+            peakMemory = counters.PeakWorkingSetSize;
+        }
+    #else
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            #ifdef __APPLE__
+                peakMemory = usage.ru_maxrss;
+            #else
+                peakMemory = (uint64_t)usage.ru_maxrss * 1024;
+            #endif
+        }
+    #endif
+    return peakMemory;
+}
 
-    int ijkl[4] = {0,0,0,0};
-    int jVals[8] = {1, 2, 4, 8, 16, 32, 64, 128};
-    for (int i=0; i<4; ++i) {
-        for (int j=0; j<8; ++j) {
-            if (roundColorValue(image[(imgIndex + i) - j*bih.biWidth]) == 0) {
-                ijkl[i] += jVals[j];
-            }
+//Writes the --stats reports to statsFile, or to the standard output when it's empty: one JSON object for a
+//single conversion, or an array of them for a batch.
+bool writeStats(bool batch) {
+    stringstream json;
+    if (batch) {
+        json << "{\"images\": [";
+        for (size_t i=0; i<statsReports.size(); ++i) {
+            json << (i == 0 ? "\n" : ",\n") << statsReports[i];
         }
+        json << "\n],\n\"allocations\": " << allocationCount << ", \"allocated_bytes\": " << allocatedBytes << "}\n";
+    }
+    else if (!statsReports.empty()) {
+        json << statsReports[0] << "\n";
+    }
+    if (statsFile.empty()) {
+        cout << "\n" << json.str();
+        return true;
+    }
+    ofstream file(statsFile.c_str());
+    file << json.str();
+    if (!file) {
+        cout << "\nError: Could not write the statistics to '" << statsFile << "'.\n";
+        return false;
     }
-    return "0x" + int2hex(ijkl[0], 2) + int2hex(ijkl[1], 2) + ", " +
-           "0x" + int2hex(ijkl[2], 2) + int2hex(ijkl[3], 2) + ", ";
+    return true;
 }
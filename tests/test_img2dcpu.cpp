@@ -0,0 +1,366 @@
+/*
+  img2dcpu - A utility for converting an image into DCPU assembly code for 0x10c.
+
+  Copyright 2012 Tyler Crumpton.
+  This utility is licensed under a GPLv3 License (see COPYING).
+  Source at: https://github.com/tac0010/img2dcpu
+
+  Regression tests for the converter library: the assembler's encodings, the RLE and LZ packers and their
+  unpacking on the built-in DCPU, and the SIMD pixel loops against the scalar rules they implement. Build it
+  with the library and run it; it exits with 1 if any check fails. See the README for the commands.
+*/
+
+#include "../src/img2dcpu.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+void check(bool passed, const string &name);
+uint32_t nextRandom();
+bool assemblesTo(const string &text, const vector<WORD> &words);
+void testAssembler();
+vector<WORD> unpackFrame(const vector<WORD> &packed, int codec, size_t &used);
+void testPackRoundTrip(const vector<WORD> &words, int codec, const string &name);
+void testPackers();
+vector<BYTE> syntheticFrames(int mode, int frames);
+void testPlayback();
+void testQuantizeColors();
+void testThresholdFrame();
+void testChoosePalette();
+
+int checks = 0, failures = 0;
+uint32_t randomState = 2463534242u;
+
+int main() {
+    testAssembler();
+    testPackers();
+    testPlayback();
+    testQuantizeColors();
+    testThresholdFrame();
+    testChoosePalette();
+    #ifdef __SSE2__
+        cout << "SIMD paths: SSE2\n";
+    #else
+        cout << "SIMD paths: none (scalar)\n";
+    #endif
+    cout << (checks - failures) << " of " << checks << " checks passed.\n";
+    return failures == 0 ? 0 : 1;
+}
+
+void check(bool passed, const string &name) {
+    ++checks;
+    if (!passed) {
+        ++failures;
+        cout << "FAILED: " << name << "\n";
+    }
+}
+
+//Xorshift, so the tests see the same values on every platform.
+uint32_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+//Whether "text" assembles into exactly "words" from address 0, with nothing after them.
+bool assemblesTo(const string &text, const vector<WORD> &words) {
+    ConverterOptions options;
+    Converter converter(options);
+    vector<WORD> memory;
+    if (!converter.assembleText(text, memory)) {
+        cout << "  " << converter.assemblerError << "\n";
+        return false;
+    }
+    return converter.wordAddress == words.size() && equal(words.begin(), words.end(), memory.begin());
+}
+
+//Instruction encodings from the DCPU-16 1.7 spec: short literals (-1 to 30) go in the a field, everything
+//else in a next word, the next word of a before that of b, and labels always take a next word.
+void testAssembler() {
+    check(assemblesTo("SET A, 0x30\n", {0x7c01, 0x0030}), "SET A, 0x30");
+    check(assemblesTo("SET [0x1000], 0x20\n", {0x7fc1, 0x0020, 0x1000}), "SET [0x1000], 0x20");
+    check(assemblesTo("SUB A, [0x1000]\n", {0x7803, 0x1000}), "SUB A, [0x1000]");
+    check(assemblesTo("IFN A, 0x10\n", {0xc413}), "IFN A, 0x10");
+    check(assemblesTo("SET I, 10\n", {0xacc1}), "SET I, 10");
+    check(assemblesTo("SUB I, 1\n", {0x88c3}), "SUB I, 1");
+    check(assemblesTo("SHL X, 4\n", {0x946f}), "SHL X, 4");
+    check(assemblesTo("SET A, 0xFFFF\n", {0x8001}), "SET A, 0xFFFF");
+    check(assemblesTo("SET A, 31\n", {0x7c01, 0x001f}), "SET A, 31");
+    check(assemblesTo("SET [J], A\n", {0x01e1}), "SET [J], A");
+    check(assemblesTo("STI [J], [I]\n", {0x39fe}), "STI [J], [I]");
+    check(assemblesTo("SET PC, POP\n", {0x6381}), "SET PC, POP");
+    check(assemblesTo("SET PUSH, Y\n", {0x1301}), "SET PUSH, Y");
+    check(assemblesTo("ADD B, EX\n", {0x7422}), "ADD B, EX");
+    check(assemblesTo("HWN I\n", {0x1a00}), "HWN I");
+    check(assemblesTo("BRK\n", {0x8b83}), "BRK");
+    check(assemblesTo("DAT 0x1234, 5, 0xFFFF\n", {0x1234, 0x0005, 0xffff}), "DAT");
+    check(assemblesTo(":start JSR sub\nSET PC, start\n:sub SET PC, POP\n",
+                      {0x7c20, 0x0004, 0x7f81, 0x0000, 0x6381}), "labels");
+    check(assemblesTo("HWI [monitor]\n:monitor DAT 7\n", {0x7a40, 0x0002, 0x0007}), "label in memory");
+    check(assemblesTo("SET A, 1\n:data DAT 0x0001, 0x0002, \nSET B, data\n", {0x8801, 0x0001, 0x0002, 0x7c21, 0x0001}),
+          "label on a DAT");
+
+    ConverterOptions options;
+    Converter converter(options);
+    vector<WORD> memory;
+    check(!converter.assembleText("SET Q, 1\n", memory) && !converter.assemblerError.empty(), "bad register");
+    check(!converter.assembleText("JSR nowhere\n", memory) && !converter.assemblerError.empty(), "undefined label");
+}
+
+//Unpacks one frame the way the DCPU unpack routine does, setting "used" to the words of "packed" it took.
+vector<WORD> unpackFrame(const vector<WORD> &packed, int codec, size_t &used) {
+    vector<WORD> words;
+    size_t i = 0;
+    while (i < packed.size() && packed[i] != 0) {
+        WORD token = packed[i++];
+        if (!(token & 0x8000)) {
+            for (int n=0; n<token && i<packed.size(); ++n) {
+                words.push_back(packed[i++]);
+            }
+        }
+        else if (i < packed.size()) {
+            WORD operand = packed[i++];
+            for (int n=0; n<(token & 0x7FFF); ++n) {
+                if (codec == RLE_CODEC) {
+                    words.push_back(operand);
+                }
+                else if (operand > 0 && operand <= words.size()) {
+                    words.push_back(words[words.size() - operand]);
+                }
+                else {
+                    return vector<WORD>(); //A copy from before the frame
+                }
+            }
+        }
+    }
+    used = i + 1;
+    return words;
+}
+
+void testPackRoundTrip(const vector<WORD> &words, int codec, const string &name) {
+    vector<WORD> packed;
+    packFrame(words.empty() ? NULL : &words[0], words.size(), codec, packed);
+    size_t used = 0;
+    vector<WORD> unpacked = unpackFrame(packed, codec, used);
+    check(unpacked == words && used == packed.size() && packed.back() == 0,
+          string(codecNames[codec]) + " round trip: " + name);
+}
+
+//Every codec must give back exactly the words it was given, including runs and literals longer than one
+//token can hold and LZ copies that overlap the words they produce.
+void testPackers() {
+    vector<vector<WORD> > inputs;
+    vector<string> names;
+    inputs.push_back(vector<WORD>());
+    names.push_back("empty");
+    inputs.push_back(vector<WORD>(1, 0x1234));
+    names.push_back("one word");
+    inputs.push_back(vector<WORD>(0x180, 0x0000));
+    names.push_back("blank frame");
+    inputs.push_back(vector<WORD>(0x12345, 0xFFFF));
+    names.push_back("run past 0x7FFE");
+    vector<WORD> noise(0x9000);
+    for (size_t i=0; i<noise.size(); ++i) {
+        noise[i] = nextRandom();
+    }
+    inputs.push_back(noise);
+    names.push_back("literals past 0x7FFE");
+    vector<WORD> pattern(0x180);
+    for (size_t i=0; i<pattern.size(); ++i) {
+        pattern[i] = 0x8000 + i % 5;
+    }
+    inputs.push_back(pattern);
+    names.push_back("repeating pattern");
+    vector<WORD> mixed(0x180);
+    for (size_t i=0; i<mixed.size(); ++i) {
+        mixed[i] = (i / 40) % 2 == 0 ? 0x0F20 : (WORD)(nextRandom() % 4);
+    }
+    inputs.push_back(mixed);
+    names.push_back("runs between noise");
+
+    for (int codec=NO_CODEC; codec<=LZ_CODEC; ++codec) {
+        for (size_t i=0; i<inputs.size(); ++i) {
+            testPackRoundTrip(inputs[i], codec, names[i]);
+        }
+    }
+
+    //The packers only pay off when the frame repeats itself:
+    vector<WORD> packed;
+    packFrame(&pattern[0], pattern.size(), LZ_CODEC, packed);
+    check(packed.size() == 1 + 5 + 2 + 1, "LZ packs a repeating pattern into five literals and one copy");
+    packed.clear();
+    packFrame(&inputs[2][0], inputs[2].size(), RLE_CODEC, packed);
+    check(packed == vector<WORD>({0x8180, 0x0000, 0x0000}), "RLE packs a blank frame into one run");
+}
+
+//An animation of "frames" frames of "mode", in one row: a blank background crossed by a moving block, with a
+//strip of noise at the bottom so that no two frames are alike.
+vector<BYTE> syntheticFrames(int mode, int frames) {
+    const int sizes[3][2] = {{LOW_RES_FULL_W, LOW_RES_FULL_H}, {HIGH_RES_FULL_W, HIGH_RES_FULL_H},
+                             {HIGH_RES_SMALL_W, HIGH_RES_SMALL_H}};
+    int width = sizes[mode][0], height = sizes[mode][1];
+    vector<BYTE> pixels((int64_t)width * frames * height * 3);
+    for (int row=0; row<height; ++row) {
+        for (int64_t column=0; column<(int64_t)width*frames; ++column) {
+            int x = column % width, frame = column / width;
+            BYTE *pixel = &pixels[(row * (int64_t)width * frames + column) * 3];
+            if (row >= height - 4) {
+                uint32_t value = nextRandom();
+                memset(pixel, value & 1 ? 0xFF : 0x00, 3);
+                if (mode == LOW_RES_FULL) {
+                    pixel[0] = value >> 8;
+                    pixel[1] = value >> 16;
+                    pixel[2] = value >> 24;
+                }
+            }
+            else if (x >= frame * 3 && x < frame * 3 + 8 && row >= 4 && row < 12) {
+                pixel[0] = 0xFF;
+                pixel[1] = mode == LOW_RES_FULL ? 0x80 : 0xFF;
+                pixel[2] = mode == LOW_RES_FULL ? 0x00 : 0xFF;
+            }
+            else {
+                memset(pixel, mode == LOW_RES_FULL ? 0x20 : 0x00, 3);
+            }
+        }
+    }
+    return pixels;
+}
+
+//Every mode, still and animated, in every layout and codec, run on the built-in DCPU and checked frame by
+//frame against its pixels.
+void testPlayback() {
+    const char *modeNames[] = {"32x24", "64x48", "64x64"};
+    const char *layoutNames[] = {"plain", "delta", "dedup", "glyphs", "rle", "lz"};
+    const int widths[3] = {LOW_RES_FULL_W, HIGH_RES_FULL_W, HIGH_RES_SMALL_W};
+    const int heights[3] = {LOW_RES_FULL_H, HIGH_RES_FULL_H, HIGH_RES_SMALL_H};
+    for (int mode=0; mode<3; ++mode) {
+        for (int frames=1; frames<=6; frames+=5) {
+            vector<BYTE> pixels = syntheticFrames(mode, frames);
+            for (int layout=0; layout<6; ++layout) {
+                if ((layout == 3 && mode != HIGH_RES_SMALL) || (frames == 1 && layout >= 1 && layout <= 3)) {
+                    continue;
+                }
+                ConverterOptions options;
+                options.deltaEncoding = layout == 1;
+                options.frameDedup = layout == 2;
+                options.glyphDictionary = layout == 3;
+                options.packingCodec = layout == 4 ? RLE_CODEC : (layout == 5 ? LZ_CODEC : NO_CODEC);
+                Converter converter(options);
+                stringstream log;
+                stringstream name;
+                name << modeNames[mode] << " " << (frames == 1 ? "still" : "animation") << ", "
+                     << layoutNames[layout];
+                bool ok = converter.setPixels(&pixels[0], widths[mode] * frames, heights[mode],
+                                              (int64_t)widths[mode] * frames * 3) &&
+                          converter.selectImageMode(log) == 0 && converter.imageMode == mode &&
+                          converter.verifyProgram(log) == 0;
+                check(ok, name.str() + " plays back on the DCPU");
+                if (!ok) {
+                    cout << log.str() << "\n";
+                }
+            }
+        }
+    }
+}
+
+//quantizeColors() must round every pixel as roundColorValue() does, whichever path it takes: every value of
+//each channel, and every count up to a few SIMD blocks so each length of scalar tail is covered.
+void testQuantizeColors() {
+    vector<BYTE> bytes(256 * 3 * 3);
+    for (int channel=0; channel<3; ++channel) {
+        for (int value=0; value<256; ++value) {
+            BYTE *pixel = &bytes[(channel * 256 + value) * 3];
+            pixel[0] = pixel[1] = pixel[2] = value ^ 0x5A;
+            pixel[channel] = value;
+        }
+    }
+    for (int count=0; count<=(int)bytes.size() / 3; count += count < 100 ? 1 : 97) {
+        vector<WORD> colors(count + 1, 0xBEEF);
+        quantizeColors(&bytes[0], count, &colors[0]);
+        bool same = colors[count] == 0xBEEF;
+        for (int i=0; i<count; ++i) {
+            same = same && colors[i] == roundColorValue(*(const RGBTRIPLE *)&bytes[i * 3]);
+        }
+        check(same, "quantizeColors matches roundColorValue for " + to_string(count) + " pixels");
+    }
+
+    vector<BYTE> noise(100003 * 3);
+    for (size_t i=0; i<noise.size(); ++i) {
+        noise[i] = nextRandom();
+    }
+    vector<WORD> colors(noise.size() / 3);
+    quantizeColors(&noise[0], colors.size(), &colors[0]);
+    bool same = true;
+    for (size_t i=0; i<colors.size(); ++i) {
+        same = same && colors[i] == roundColorValue(*(const RGBTRIPLE *)&noise[i * 3]);
+    }
+    check(same, "quantizeColors matches roundColorValue on random pixels");
+}
+
+//thresholdFrame() must set the bit of every pixel whose three channels are all below 8, and only those, in
+//frames side by side and for pixels near the threshold.
+void testThresholdFrame() {
+    const int frames = 3;
+    vector<BYTE> pixels(HIGH_RES_FULL_W * frames * HIGH_RES_FULL_H * 3);
+    for (size_t i=0; i<pixels.size(); ++i) {
+        uint32_t value = nextRandom();
+        pixels[i] = value & 0x100 ? value % 16 : value; //Half of them within 8 of the threshold
+    }
+    ConverterOptions options;
+    Converter converter(options);
+    stringstream log;
+    if (!converter.setPixels(&pixels[0], HIGH_RES_FULL_W * frames, HIGH_RES_FULL_H, HIGH_RES_FULL_W * frames * 3) ||
+        converter.selectImageMode(log) != 0) {
+        check(false, "thresholdFrame test image");
+        return;
+    }
+    for (int x=0; x<frames; ++x) {
+        uint64_t plane[HIGH_RES_FULL_H];
+        converter.thresholdFrame(x, plane);
+        bool same = true;
+        for (int row=0; row<HIGH_RES_FULL_H; ++row) {
+            for (int column=0; column<HIGH_RES_FULL_W; ++column) {
+                const BYTE *pixel = &pixels[(row * HIGH_RES_FULL_W * frames + x * HIGH_RES_FULL_W + column) * 3];
+                bool black = pixel[0] < 8 && pixel[1] < 8 && pixel[2] < 8;
+                same = same && ((plane[row] >> column & 1) != 0) == black;
+            }
+        }
+        check(same, "thresholdFrame matches the threshold in frame " + to_string(x));
+    }
+}
+
+//Every palette algorithm must leave an empty histogram's palette black rather than divide by its count, and
+//find the one color of a single color histogram.
+void testChoosePalette() {
+    const char *names[] = {"popular", "median cut", "k-means"};
+    const int algorithms[] = {POPULAR_PALETTE, MEDIAN_CUT_PALETTE, K_MEANS_PALETTE};
+    for (int a=0; a<3; ++a) {
+        ConverterOptions options;
+        options.paletteAlgorithm = algorithms[a];
+        Converter converter(options);
+        uint64_t colorCounts[4096] = {};
+        int palette[16][3];
+        memset(palette, 0xFF, sizeof(palette));
+        converter.choosePalette(colorCounts, palette);
+        bool black = true;
+        for (int i=0; i<16; ++i) {
+            black = black && palette[i][0] == 0 && palette[i][1] == 0 && palette[i][2] == 0;
+        }
+        check(black, string(names[a]) + " palette of an empty histogram is black");
+
+        colorCounts[0xA5C] = 1000;
+        converter.choosePalette(colorCounts, palette);
+        bool found = false;
+        for (int i=0; i<16; ++i) {
+            found = found || (palette[i][0] == 0xA && palette[i][1] == 0x5 && palette[i][2] == 0xC);
+        }
+        check(found, string(names[a]) + " palette of a single color histogram has that color");
+    }
+}